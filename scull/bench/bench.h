@@ -0,0 +1,232 @@
+/*
+ * Helpers shared by the scull benchmarks: clocks, CPU pinning, latency
+ * percentiles and log2 histograms.  Everything is static inline, so that
+ * each program only keeps what it uses.
+ */
+#ifndef SCULL_BENCH_H
+#define SCULL_BENCH_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/types.h>
+
+#include "../scull.h"
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void die(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+/* Pin the calling thread; a negative cpu leaves it wherever it is */
+static inline void pin(int cpu)
+{
+    cpu_set_t set;
+    int err;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) {
+        errno = err;
+        die("pthread_setaffinity_np");
+    }
+}
+
+static inline void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (!p)
+        die("malloc");
+    return p;
+}
+
+static inline int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sorts "lat" and prints its percentiles, in microseconds */
+static inline void report_lat(const char *name, uint64_t *lat, size_t n)
+{
+    if (!n) {
+        printf("%-24s no samples\n", name);
+        return;
+    }
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    printf("%-24s p50 %8.2f  p99 %8.2f  p99.9 %8.2f  max %9.2f us\n", name,
+            lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3,
+            lat[n * 999 / 1000] / 1e3, lat[n - 1] / 1e3);
+}
+
+/* Latencies bucketed by power of two of nanoseconds, like the module's */
+#define HIST_BUCKETS 64
+
+struct hist {
+    uint64_t b[HIST_BUCKETS];
+    uint64_t n;
+};
+
+static inline void hist_add(struct hist *h, uint64_t ns)
+{
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+    h->b[b < HIST_BUCKETS ? b : HIST_BUCKETS - 1]++;
+    h->n++;
+}
+
+static inline void hist_print(const char *name, const struct hist *h)
+{
+    uint64_t sum = 0;
+
+    printf("%s: %llu samples\n", name, (unsigned long long)h->n);
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        if (!h->b[b])
+            continue;
+        sum += h->b[b];
+        printf("  < %10llu ns %10llu  %6.2f%%  cum %6.2f%%\n",
+                b ? 1ull << b : 1ull, (unsigned long long)h->b[b],
+                100.0 * h->b[b] / h->n, 100.0 * sum / h->n);
+    }
+}
+
+/*
+ * The quantum of bare device "dev", from sysfs; SCULL_QUANTUM if that
+ * cannot be read, as for a plain file standing in for a device.
+ */
+static inline int dev_quantum(const char *dev)
+{
+    const char *name = strrchr(dev, '/');
+    char path[256];
+    int quantum;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/class/scull/%s/quantum", name ? name + 1 : dev);
+    f = fopen(path, "r");
+    if (!f)
+        return SCULL_QUANTUM;
+    if (fscanf(f, "%d", &quantum) != 1 || quantum <= 0)
+        quantum = SCULL_QUANTUM;
+    fclose(f);
+    return quantum;
+}
+
+/*
+ * A random offset of "bytes" within the first "span" bytes of a device
+ * that never crosses a quantum, which a bare device would cut short.
+ * Needs bytes <= quantum.
+ */
+static inline off_t quantum_offset(unsigned int *seed, size_t span, int quantum,
+        size_t bytes)
+{
+    size_t nquanta = span / quantum ? span / quantum : 1;
+
+    return (off_t)(rand_r(seed) % nquanta) * quantum +
+        rand_r(seed) % (quantum / bytes) * bytes;
+}
+
+/* Write "size" bytes of "c" from offset 0, however much each write takes */
+static inline void fill_dev(int fd, size_t size, int c)
+{
+    size_t chunk = 1 << 20, done = 0;
+    char *buf = malloc(chunk);
+
+    if (!buf)
+        die("malloc");
+    memset(buf, c, chunk);
+    while (done < size) {
+        size_t n = size - done < chunk ? size - done : chunk;
+        ssize_t put = pwrite(fd, buf, n, done);
+
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            die("pwrite");
+        done += put;
+    }
+    free(buf);
+}
+
+/*
+ * The two ends of a byte stream: a scull pipe device opened once for
+ * reading and once for writing, or an anonymous pipe if "dev" is NULL.
+ */
+struct chan {
+    int rd, wr;
+};
+
+static inline void chan_open(struct chan *c, const char *dev)
+{
+    int fds[2];
+
+    if (!dev) {
+        if (pipe(fds))
+            die("pipe");
+        c->rd = fds[0];
+        c->wr = fds[1];
+        return;
+    }
+    c->rd = open(dev, O_RDONLY);
+    if (c->rd < 0)
+        die(dev);
+    c->wr = open(dev, O_WRONLY);
+    if (c->wr < 0)
+        die(dev);
+}
+
+static inline void chan_close(struct chan *c)
+{
+    close(c->rd);
+    close(c->wr);
+}
+
+static inline void read_full(int fd, void *buf, size_t n)
+{
+    while (n) {
+        ssize_t got = read(fd, buf, n);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            die("read");
+        buf = (char *)buf + got;
+        n -= got;
+    }
+}
+
+static inline void write_full(int fd, const void *buf, size_t n)
+{
+    while (n) {
+        ssize_t put = write(fd, buf, n);
+
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            die("write");
+        buf = (const char *)buf + put;
+        n -= put;
+    }
+}
+
+#endif /* SCULL_BENCH_H */
@@ -0,0 +1,104 @@
+/*
+ * Round-trip latency of one byte bounced between two threads over a pair
+ * of scullpipes, with the readers sleeping at once and then busy-polling
+ * for up to -u microseconds first, as a log2 histogram of nanoseconds.
+ * -g makes the initiator wait that many nanoseconds between round trips,
+ * so that the other side goes idle as a real consumer would.
+ *
+ *   busypoll_bench [-d dev] [-e dev] [-r rounds] [-u us] [-g gap_ns]
+ *                  [-p cpu] [-q cpu]
+ */
+#include <getopt.h>
+#include <sys/ioctl.h>
+
+#include "bench.h"
+
+static const char *dev = "/dev/scullpipe0";
+static const char *dev2 = "/dev/scullpipe1";   /* the way back */
+static long rounds = 100000;
+static unsigned long budget = 50;
+static uint64_t gap;
+static int cpu_a = -1, cpu_b = -1;
+
+static struct chan there, back;
+
+static void *echo(void *arg)
+{
+    char b;
+
+    pin(cpu_b);
+    for (long i = 0; i < rounds; i++) {
+        read_full(there.rd, &b, 1);
+        write_full(back.wr, &b, 1);
+    }
+    return NULL;
+}
+
+static void run(const char *name, unsigned long us)
+{
+    uint64_t *lat = xmalloc(rounds * sizeof(*lat));
+    struct hist h;
+    pthread_t t;
+    char b = 'p';
+
+    if (ioctl(there.rd, SCULL_P_IOCSBUSYPOLL, us) < 0 ||
+            ioctl(back.rd, SCULL_P_IOCSBUSYPOLL, us) < 0)
+        die("SCULL_P_IOCSBUSYPOLL");
+
+    memset(&h, 0, sizeof(h));
+    pin(cpu_a);
+    if (pthread_create(&t, NULL, echo, NULL))
+        die("pthread_create");
+    for (long i = 0; i < rounds; i++) {
+        uint64_t t0 = now_ns();
+
+        write_full(there.wr, &b, 1);
+        read_full(back.rd, &b, 1);
+        lat[i] = now_ns() - t0;
+        hist_add(&h, lat[i]);
+        while (now_ns() < t0 + lat[i] + gap)
+            ;
+    }
+    pthread_join(t, NULL);
+
+    hist_print(name, &h);
+    report_lat(name, lat, rounds);
+    free(lat);
+}
+
+int main(int argc, char **argv)
+{
+    char name[64];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:e:r:u:g:p:q:")) != -1) {
+        switch (opt) {
+        case 'd': dev = optarg; break;
+        case 'e': dev2 = optarg; break;
+        case 'r': rounds = atol(optarg); break;
+        case 'u': budget = atol(optarg); break;
+        case 'g': gap = atoll(optarg); break;
+        case 'p': cpu_a = atoi(optarg); break;
+        case 'q': cpu_b = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-d dev] [-e dev] [-r rounds] [-u us] "
+                    "[-g gap_ns] [-p cpu] [-q cpu]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (rounds <= 0 || budget > SCULL_P_BUSY_POLL_MAX) {
+        fprintf(stderr, "need rounds > 0 and at most %d us of busy polling\n",
+                SCULL_P_BUSY_POLL_MAX);
+        return 1;
+    }
+
+    chan_open(&there, dev);
+    chan_open(&back, dev2);
+    printf("%ld round trips, %llu ns apart\n", rounds, (unsigned long long)gap);
+    run("sleeping reads", 0);
+    snprintf(name, sizeof(name), "busy-polling %lu us", budget);
+    run(name, budget);
+    chan_close(&there);
+    chan_close(&back);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * A producer making tiny writes and a consumer reading whatever is there,
+ * through an anonymous pipe, a scullpipe waking its reader on every write,
+ * and a scullpipe with the reader's wakeups coalesced.  Prints, per MB
+ * moved, the context switches of both threads together, the reads it took
+ * and, for scullpipe, the wakeups the coalescing avoided.
+ *
+ *   coalesce_bench [-d dev] [-n bytes] [-m size] [-B bytes] [-M msgs]
+ *                  [-t delay_ns] [-p cpu] [-q cpu]
+ */
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+
+static const char *dev = "/dev/scullpipe0";
+static size_t total = 64 << 20;
+static size_t size = 16;
+static struct scull_p_coalesce coal = { .bytes = 4096, .msgs = 64, .delay_ns = 50000 };
+static int cpu_prod = -1, cpu_cons = -1;
+
+static long thread_csw(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_THREAD, &ru))
+        die("getrusage");
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static void *producer(void *arg)
+{
+    struct chan *c = arg;
+    char *msg = xmalloc(size);
+    long csw;
+
+    pin(cpu_prod);
+    csw = thread_csw();
+    memset(msg, 'm', size);
+    for (size_t done = 0; done < total; done += size)
+        write_full(c->wr, msg, size);
+    free(msg);
+    return (void *)(thread_csw() - csw);
+}
+
+static void run(const char *name, struct chan *c, int scull)
+{
+    size_t bufsize = 64 << 10, done = 0;
+    char *buf = xmalloc(bufsize);
+    long reads = 0, csw;
+    __u64 avoided0 = 0, avoided = 0;
+    double mb = total / 1e6;
+    pthread_t t;
+    void *prod_csw;
+
+    if (scull && ioctl(c->rd, SCULL_P_IOCGAVOIDED, &avoided0) < 0)
+        die("SCULL_P_IOCGAVOIDED");
+    pin(cpu_cons);
+    csw = thread_csw();
+    if (pthread_create(&t, NULL, producer, c))
+        die("pthread_create");
+    while (done < total) {
+        ssize_t got = read(c->rd, buf, bufsize);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            die("read");
+        done += got;
+        reads++;
+    }
+    csw = thread_csw() - csw;
+    pthread_join(t, &prod_csw);
+    if (scull && ioctl(c->rd, SCULL_P_IOCGAVOIDED, &avoided) < 0)
+        die("SCULL_P_IOCGAVOIDED");
+
+    printf("%-24s %10.1f csw/MB %10.1f reads/MB", name,
+            (csw + (long)prod_csw) / mb, reads / mb);
+    if (scull)
+        printf(" %10.1f avoided/MB", (avoided - avoided0) / mb);
+    printf("\n");
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    struct scull_p_coalesce none = { .bytes = 1, .msgs = 1 };
+    struct chan c;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:m:B:M:t:p:q:")) != -1) {
+        switch (opt) {
+        case 'd': dev = optarg; break;
+        case 'n': total = atol(optarg); break;
+        case 'm': size = atol(optarg); break;
+        case 'B': coal.bytes = atoi(optarg); break;
+        case 'M': coal.msgs = atoi(optarg); break;
+        case 't': coal.delay_ns = atoll(optarg); break;
+        case 'p': cpu_prod = atoi(optarg); break;
+        case 'q': cpu_cons = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-d dev] [-n bytes] [-m size] [-B bytes] "
+                    "[-M msgs] [-t delay_ns] [-p cpu] [-q cpu]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!size || total < size) {
+        fprintf(stderr, "need 0 < size <= bytes\n");
+        return 1;
+    }
+    total -= total % size;
+
+    printf("%zu bytes in writes of %zu; coalescing %u bytes, %u msgs, %llu ns\n",
+            total, size, coal.bytes, coal.msgs, (unsigned long long)coal.delay_ns);
+
+    chan_open(&c, NULL);
+    run("pipe", &c, 0);
+    chan_close(&c);
+
+    chan_open(&c, dev);
+    if (ioctl(c.rd, SCULL_P_IOCSCOALESCE, &none) < 0)
+        die("SCULL_P_IOCSCOALESCE");
+    run("scullpipe, every write", &c, 1);
+    if (ioctl(c.rd, SCULL_P_IOCSCOALESCE, &coal) < 0)
+        die("SCULL_P_IOCSCOALESCE");
+    run("scullpipe, coalesced", &c, 1);
+    chan_close(&c);
+    return 0;
+}
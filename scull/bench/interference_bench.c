@@ -0,0 +1,121 @@
+/*
+ * Cross-device interference: thread i hammers /dev/sculli with small
+ * writes and reads at one offset, first alone and then with all the
+ * others running at once, each on its own device; -c pins them to
+ * consecutive CPUs from the one given.  Devices that share nothing keep
+ * their rate when run together, given a CPU each, while false sharing of
+ * their state shows up as a drop.  Run it against modules built before
+ * and after a layout change to compare the two.
+ *
+ *   interference_bench [-d prefix] [-N devices] [-b bytes] [-t seconds]
+ *                      [-c first cpu]
+ */
+#include <getopt.h>
+
+#include "bench.h"
+
+static const char *prefix = "/dev/scull";
+static int ndevs = 4;
+static size_t bytes = 8;
+static double seconds = 2;
+static int first_cpu = -1;          /* no pinning */
+
+struct worker {
+    pthread_t thread;
+    char path[64];
+    int fd;
+    int cpu;
+    double rate;                /* ops/s */
+};
+
+static volatile int go, stop;
+
+static void *hammer(void *arg)
+{
+    struct worker *w = arg;
+    char *buf = xmalloc(bytes);
+    uint64_t t0;
+    long ops = 0;
+
+    pin(w->cpu);
+    memset(buf, 'i', bytes);
+    while (!go)
+        ;
+    t0 = now_ns();
+    while (!stop) {
+        if (pwrite(w->fd, buf, bytes, 0) != (ssize_t)bytes ||
+                pread(w->fd, buf, bytes, 0) != (ssize_t)bytes)
+            die("pwrite/pread");
+        ops += 2;
+    }
+    w->rate = ops * 1e9 / (now_ns() - t0);
+    free(buf);
+    return NULL;
+}
+
+/* Run workers [from, to) together for the configured time */
+static void run(struct worker *w, int from, int to)
+{
+    go = stop = 0;
+    for (int i = from; i < to; i++)
+        if (pthread_create(&w[i].thread, NULL, hammer, &w[i]))
+            die("pthread_create");
+    go = 1;
+    usleep(seconds * 1e6);
+    stop = 1;
+    for (int i = from; i < to; i++)
+        pthread_join(w[i].thread, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    struct worker *w;
+    double *alone;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:N:b:t:c:")) != -1) {
+        switch (opt) {
+        case 'd': prefix = optarg; break;
+        case 'N': ndevs = atoi(optarg); break;
+        case 'b': bytes = atol(optarg); break;
+        case 't': seconds = atof(optarg); break;
+        case 'c': first_cpu = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-d prefix] [-N devices] [-b bytes] "
+                    "[-t seconds] [-c first cpu]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (ndevs <= 0 || !bytes || seconds <= 0) {
+        fprintf(stderr, "need devices, bytes and seconds > 0\n");
+        return 1;
+    }
+
+    w = xmalloc(ndevs * sizeof(*w));
+    alone = xmalloc(ndevs * sizeof(*alone));
+    for (int i = 0; i < ndevs; i++) {
+        snprintf(w[i].path, sizeof(w[i].path), "%s%d", prefix, i);
+        w[i].fd = open(w[i].path, O_RDWR);
+        if (w[i].fd < 0)
+            die(w[i].path);
+        w[i].cpu = first_cpu < 0 ? -1 : first_cpu + i;
+    }
+
+    for (int i = 0; i < ndevs; i++) {
+        run(w, i, i + 1);
+        alone[i] = w[i].rate;
+    }
+    run(w, 0, ndevs);
+
+    printf("%-16s %5s %14s %14s %8s\n", "device", "cpu", "alone ops/s",
+            "together ops/s", "ratio");
+    for (int i = 0; i < ndevs; i++)
+        printf("%-16s %5d %14.0f %14.0f %8.3f\n", w[i].path, w[i].cpu,
+                alone[i], w[i].rate, w[i].rate / alone[i]);
+
+    for (int i = 0; i < ndevs; i++)
+        close(w[i].fd);
+    free(alone);
+    free(w);
+    return 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * Quantum placement across sockets: for each placement policy, a writer
+ * pinned to one node fills a bare device, then a reader pinned to each
+ * node with memory reads it all back.  Prints each reader's bandwidth and
+ * where the quanta ended up (from debugfs, if it is mounted and readable).
+ * The policy is set through sysfs, so this needs to run as root.
+ *
+ *   numa_bench [-d dev] [-s bytes] [-b block] [-w node] [-r rounds]
+ */
+#include <getopt.h>
+#include <libgen.h>
+#include <numa.h>
+
+#include "bench.h"
+
+static const char *dev = "/dev/scull0";
+static size_t size = 64 << 20;
+static size_t block = 64 << 10;
+static int writer_node;
+static int rounds = 5;
+
+static const char * const policies[] = { "fixed", "interleave", "local", "replicate" };
+
+static char sysdir[256], dbgfile[256];
+
+static void sysfs_write(const char *attr, const char *val)
+{
+    char path[512];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", sysdir, attr);
+    f = fopen(path, "w");
+    if (!f || fputs(val, f) < 0 || fclose(f))
+        die(path);
+}
+
+static int sysfs_read_int(const char *attr)
+{
+    char path[512];
+    FILE *f;
+    int val;
+
+    snprintf(path, sizeof(path), "%s/%s", sysdir, attr);
+    f = fopen(path, "r");
+    if (!f || fscanf(f, "%d", &val) != 1)
+        die(path);
+    fclose(f);
+    return val;
+}
+
+static void run_on(int node)
+{
+    if (numa_run_on_node(node))
+        die("numa_run_on_node");
+}
+
+/* Truncate the device and fill it, from "node" */
+static void fill(int node)
+{
+    char *buf = xmalloc(block);
+    int fd;
+
+    run_on(node);
+    memset(buf, 'n', block);
+    fd = open(dev, O_WRONLY);          /* write-only: empties it */
+    if (fd < 0)
+        die(dev);
+    for (size_t done = 0; done < size; done += block)
+        write_full(fd, buf, block);
+    close(fd);
+    free(buf);
+}
+
+static double read_all(int node)
+{
+    char *buf = xmalloc(block);
+    uint64_t t0;
+    ssize_t n;
+    int fd;
+
+    run_on(node);
+    fd = open(dev, O_RDONLY);
+    if (fd < 0)
+        die(dev);
+    t0 = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        /* a bare device returns at most a quantum per read */
+        for (size_t done = 0; done < size; done += n) {
+            n = pread(fd, buf, block, done);
+            if (n <= 0) {
+                if (!n)
+                    errno = EIO;       /* shorter than we wrote */
+                die("pread");
+            }
+        }
+    }
+    close(fd);
+    free(buf);
+    return (double)size * rounds / 1e6 / ((now_ns() - t0) / 1e9);
+}
+
+/* The "nodes:" part of the debugfs memory file */
+static void show_nodes(void)
+{
+    char line[256];
+    int in_nodes = 0;
+    FILE *f = fopen(dbgfile, "r");
+
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strcmp(line, "nodes:\n"))
+            in_nodes = 1;
+        else if (in_nodes && line[0] != ' ')
+            break;
+        else if (in_nodes)
+            printf("    quanta on node%s", line + 1);
+    }
+    fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+    char *devname;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:s:b:w:r:")) != -1) {
+        switch (opt) {
+        case 'd': dev = optarg; break;
+        case 's': size = atol(optarg); break;
+        case 'b': block = atol(optarg); break;
+        case 'w': writer_node = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-d dev] [-s bytes] [-b block] [-w node] "
+                    "[-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!block || size < block || rounds <= 0) {
+        fprintf(stderr, "need 0 < block <= bytes and rounds > 0\n");
+        return 1;
+    }
+    size -= size % block;
+    if (numa_available() < 0) {
+        fprintf(stderr, "no NUMA support here\n");
+        return 1;
+    }
+
+    devname = basename(strdup(dev));
+    snprintf(sysdir, sizeof(sysdir), "/sys/class/scull/%s", devname);
+    snprintf(dbgfile, sizeof(dbgfile), "/sys/kernel/debug/scull/%s/memory", devname);
+    printf("%s: %zu bytes written from node %d, read %d times from each node\n",
+            dev, size, writer_node, rounds);
+
+    for (int p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        sysfs_write("policy", policies[p]);
+        fill(writer_node);
+        if (!strcmp(policies[p], "replicate")) {
+            /* the copies are made in the background, after the close */
+            for (int i = 0; i < 1000 && !sysfs_read_int("frozen"); i++)
+                usleep(10000);
+            if (!sysfs_read_int("frozen"))
+                printf("  (%s did not freeze)\n", dev);
+        }
+
+        printf("%s:\n", policies[p]);
+        show_nodes();
+        for (int node = 0; node <= numa_max_node(); node++) {
+            if (!numa_bitmask_isbitset(numa_all_nodes_ptr, node))
+                continue;
+            printf("    read from node %-4d %10.1f MB/s\n", node, read_all(node));
+        }
+    }
+    sysfs_write("policy", "fixed");
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * scullpipe against an anonymous pipe: throughput of one writer and one
+ * reader streaming blocks through it, and round-trip latency of one byte
+ * bounced between two threads over a pair of them.  scullpipe's ring is
+ * scull_p_buffer bytes (4 KiB by default) against 64 KiB for a pipe; load
+ * with scull_p_buffer=65536 to compare like with like.
+ *
+ *   pipe_bench [-d dev] [-e dev] [-n bytes] [-b block] [-r rounds]
+ *              [-p cpu] [-q cpu]
+ */
+#include <getopt.h>
+
+#include "bench.h"
+
+static const char *dev = "/dev/scullpipe0";
+static const char *dev2 = "/dev/scullpipe1";   /* the way back */
+static size_t total = 1 << 30;
+static size_t block = 4096;
+static long rounds = 100000;
+static int cpu_a = -1, cpu_b = -1;
+
+struct pair {
+    struct chan *there, *back;
+};
+
+static void *stream_writer(void *arg)
+{
+    struct chan *c = arg;
+    char *buf = xmalloc(block);
+
+    pin(cpu_b);
+    memset(buf, 'w', block);
+    for (size_t done = 0; done < total; done += block)
+        write_full(c->wr, buf, block);
+    free(buf);
+    return NULL;
+}
+
+static void throughput(const char *name, struct chan *c)
+{
+    char *buf = xmalloc(block);
+    pthread_t t;
+    uint64_t t0;
+
+    pin(cpu_a);
+    t0 = now_ns();
+    if (pthread_create(&t, NULL, stream_writer, c))
+        die("pthread_create");
+    for (size_t done = 0; done < total; done += block)
+        read_full(c->rd, buf, block);
+    pthread_join(t, NULL);
+    printf("%-24s %10.1f MB/s\n", name, total / 1e6 / ((now_ns() - t0) / 1e9));
+    free(buf);
+}
+
+static void *echo(void *arg)
+{
+    struct pair *p = arg;
+    char b;
+
+    pin(cpu_b);
+    for (long i = 0; i < rounds; i++) {
+        read_full(p->there->rd, &b, 1);
+        write_full(p->back->wr, &b, 1);
+    }
+    return NULL;
+}
+
+static void latency(const char *name, struct chan *there, struct chan *back)
+{
+    struct pair p = { there, back };
+    uint64_t *lat = xmalloc(rounds * sizeof(*lat));
+    pthread_t t;
+    char b = 'p';
+
+    pin(cpu_a);
+    if (pthread_create(&t, NULL, echo, &p))
+        die("pthread_create");
+    for (long i = 0; i < rounds; i++) {
+        uint64_t t0 = now_ns();
+
+        write_full(there->wr, &b, 1);
+        read_full(back->rd, &b, 1);
+        lat[i] = now_ns() - t0;
+    }
+    pthread_join(t, NULL);
+    report_lat(name, lat, rounds);
+    free(lat);
+}
+
+int main(int argc, char **argv)
+{
+    struct chan a, b;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:e:n:b:r:p:q:")) != -1) {
+        switch (opt) {
+        case 'd': dev = optarg; break;
+        case 'e': dev2 = optarg; break;
+        case 'n': total = atol(optarg); break;
+        case 'b': block = atol(optarg); break;
+        case 'r': rounds = atol(optarg); break;
+        case 'p': cpu_a = atoi(optarg); break;
+        case 'q': cpu_b = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-d dev] [-e dev] [-n bytes] [-b block] "
+                    "[-r rounds] [-p cpu] [-q cpu]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!block || total < block || rounds <= 0) {
+        fprintf(stderr, "need 0 < block <= bytes and rounds > 0\n");
+        return 1;
+    }
+    total -= total % block;
+
+    printf("%zu bytes in blocks of %zu; %ld round trips\n", total, block, rounds);
+
+    chan_open(&a, dev);
+    throughput(dev, &a);
+    chan_open(&b, dev2);
+    latency(dev, &a, &b);
+    chan_close(&a);
+    chan_close(&b);
+
+    chan_open(&a, NULL);
+    throughput("pipe", &a);
+    chan_open(&b, NULL);
+    latency("pipe", &a, &b);
+    chan_close(&a);
+    chan_close(&b);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * One producer and one consumer thread, pinned, passing timestamped
+ * messages through a scullpipe in its default (locked) mode, then in
+ * SPSC mode, then through an anonymous pipe for reference.  Prints the
+ * messages per second and the handoff latency, from the producer's
+ * timestamp to the consumer having read it.  With -g the producer spaces
+ * its messages that many nanoseconds apart, to measure the handoff
+ * without queueing behind a full ring.
+ *
+ *   spsc_bench [-d dev] [-n msgs] [-m size] [-g gap_ns] [-p cpu] [-q cpu]
+ */
+#include <getopt.h>
+#include <sys/ioctl.h>
+
+#include "bench.h"
+
+static const char *dev = "/dev/scullpipe0";
+static long msgs = 1000000;
+static size_t size = sizeof(uint64_t);
+static uint64_t gap;
+static int cpu_prod = -1, cpu_cons = -1;
+
+static void *producer(void *arg)
+{
+    struct chan *c = arg;
+    char *msg = xmalloc(size);
+    uint64_t next = now_ns();
+
+    pin(cpu_prod);
+    memset(msg, 'm', size);
+    for (long i = 0; i < msgs; i++) {
+        uint64_t ts;
+
+        if (gap) {
+            next += gap;
+            while (now_ns() < next)
+                ;
+        }
+        ts = now_ns();
+        memcpy(msg, &ts, sizeof(ts));
+        write_full(c->wr, msg, size);
+    }
+    free(msg);
+    return NULL;
+}
+
+static void run(const char *name, struct chan *c)
+{
+    uint64_t *lat = xmalloc(msgs * sizeof(*lat));
+    char *msg = xmalloc(size);
+    uint64_t t0, elapsed;
+    pthread_t t;
+
+    pin(cpu_cons);
+    t0 = now_ns();
+    if (pthread_create(&t, NULL, producer, c))
+        die("pthread_create");
+    for (long i = 0; i < msgs; i++) {
+        uint64_t ts;
+
+        read_full(c->rd, msg, size);
+        memcpy(&ts, msg, sizeof(ts));
+        lat[i] = now_ns() - ts;
+    }
+    elapsed = now_ns() - t0;
+    pthread_join(t, NULL);
+
+    printf("%-24s %10.0f msgs/s\n", name, msgs * 1e9 / elapsed);
+    report_lat(name, lat, msgs);
+    free(msg);
+    free(lat);
+}
+
+static void set_mode(struct chan *c, int mode)
+{
+    if (ioctl(c->wr, SCULL_P_IOCSMODE, mode) < 0)
+        die("SCULL_P_IOCSMODE");
+}
+
+int main(int argc, char **argv)
+{
+    struct chan c;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:m:g:p:q:")) != -1) {
+        switch (opt) {
+        case 'd': dev = optarg; break;
+        case 'n': msgs = atol(optarg); break;
+        case 'm': size = atol(optarg); break;
+        case 'g': gap = atoll(optarg); break;
+        case 'p': cpu_prod = atoi(optarg); break;
+        case 'q': cpu_cons = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-d dev] [-n msgs] [-m size] [-g gap_ns] "
+                    "[-p cpu] [-q cpu]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (size < sizeof(uint64_t) || msgs <= 0) {
+        fprintf(stderr, "need size >= %zu and msgs > 0\n", sizeof(uint64_t));
+        return 1;
+    }
+
+    printf("%ld messages of %zu bytes, %llu ns apart\n", msgs, size,
+            (unsigned long long)gap);
+
+    chan_open(&c, dev);
+    set_mode(&c, SCULL_P_MODE_DEFAULT);
+    run("scullpipe, locked", &c);
+    set_mode(&c, SCULL_P_MODE_SPSC);
+    run("scullpipe, SPSC", &c);
+    set_mode(&c, SCULL_P_MODE_DEFAULT);
+    chan_close(&c);
+
+    chan_open(&c, NULL);
+    run("pipe", &c);
+    chan_close(&c);
+    return 0;
+}
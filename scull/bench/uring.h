@@ -0,0 +1,116 @@
+/*
+ * Just enough io_uring for the benchmarks, straight on the system calls,
+ * so that they build without liburing: one ring, regular 64-byte SQEs,
+ * submissions batched until uring_submit().
+ */
+#ifndef SCULL_URING_H
+#define SCULL_URING_H
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "bench.h"
+
+struct uring {
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int sq_entries;
+    unsigned int sq_local;      /* tail including SQEs not submitted yet */
+};
+
+static inline void uring_init(struct uring *r, unsigned int entries)
+{
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        die("io_uring_setup");
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        die("mmap sq ring");
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            die("mmap cq ring");
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        die("mmap sqes");
+
+    r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->sq_local = *r->sq_tail;
+}
+
+/* A zeroed SQE, or NULL if the ring is full */
+static inline struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+    unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int idx = r->sq_local & *r->sq_mask;
+
+    if (r->sq_local - head == r->sq_entries)
+        return NULL;
+    r->sq_local++;
+    r->sq_array[idx] = idx;
+    memset(&r->sqes[idx], 0, sizeof(r->sqes[idx]));
+    return &r->sqes[idx];
+}
+
+/* Submit what uring_sqe() handed out, and wait for "wait" completions */
+static inline int uring_submit(struct uring *r, unsigned int wait)
+{
+    unsigned int n = r->sq_local - *r->sq_tail;
+    int ret;
+
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, n, wait,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0)
+        die("io_uring_enter");
+    return ret;
+}
+
+/* Take a completion if there is one: 1 if so, 0 if not */
+static inline int uring_peek(struct uring *r, struct io_uring_cqe *cqe)
+{
+    unsigned int head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    *cqe = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static inline void uring_wait(struct uring *r, struct io_uring_cqe *cqe)
+{
+    while (!uring_peek(r, cqe))
+        uring_submit(r, 1);
+}
+
+#endif /* SCULL_URING_H */
@@ -0,0 +1,167 @@
+/*
+ * Small positional reads and writes at random offsets, "batch" at a time,
+ * four ways: a pread()/pwrite() each; an io_uring READ/WRITE SQE each,
+ * submitted together; one SCULL_IOCREADV/WRITEV ioctl; and one
+ * SCULL_URING_CMD_READV/WRITEV passthrough SQE.  The last two take the
+ * device lock once per batch, and the last completes once.  Prints the
+ * extents moved per second and the latency of whole batches.  No extent
+ * crosses a quantum, so that each one moves all its bytes.
+ *
+ *   uring_batch [-d dev] [-n extents] [-B batch] [-b bytes] [-s span]
+ */
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+
+#include "uring.h"
+
+static const char *dev = "/dev/scull0";
+static long total = 1000000;
+static int batch = 64;
+static size_t bytes = 64;
+static size_t span = 1 << 20;
+
+static int fd, quantum;
+static struct uring r;
+static struct scull_extent *ext;
+static char *bufs;
+
+enum way { SYSCALLS, URING, IOCTL, URING_CMD };
+
+static void do_batch(enum way way, int write)
+{
+    struct io_uring_cqe cqe;
+    struct scull_batch b = {
+        .extents = (uintptr_t)ext,
+        .nr_extents = batch,
+    };
+    struct io_uring_sqe *sqe;
+
+    switch (way) {
+    case SYSCALLS:
+        for (int i = 0; i < batch; i++) {
+            void *buf = (void *)(uintptr_t)ext[i].addr;
+            ssize_t n = write ? pwrite(fd, buf, bytes, ext[i].offset) :
+                pread(fd, buf, bytes, ext[i].offset);
+
+            if (n != (ssize_t)bytes)
+                die(write ? "pwrite" : "pread");
+        }
+        break;
+    case URING:
+        for (int i = 0; i < batch; i++) {
+            sqe = uring_sqe(&r);
+            sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = ext[i].addr;
+            sqe->len = bytes;
+            sqe->off = ext[i].offset;
+        }
+        uring_submit(&r, batch);
+        for (int i = 0; i < batch; i++) {
+            uring_wait(&r, &cqe);
+            if (cqe.res != (int)bytes) {
+                errno = cqe.res < 0 ? -cqe.res : EIO;
+                die("io_uring read/write");
+            }
+        }
+        break;
+    case IOCTL:
+        if (ioctl(fd, write ? SCULL_IOCWRITEV : SCULL_IOCREADV, &b) < 0)
+            die("ioctl");
+        break;
+    case URING_CMD:
+        sqe = uring_sqe(&r);
+        sqe->opcode = IORING_OP_URING_CMD;
+        sqe->fd = fd;
+        sqe->cmd_op = write ? SCULL_URING_CMD_WRITEV : SCULL_URING_CMD_READV;
+        memcpy(sqe->cmd, &b, sizeof(b));
+        uring_submit(&r, 1);
+        uring_wait(&r, &cqe);
+        if (cqe.res < 0) {
+            errno = -cqe.res;
+            die("uring_cmd");
+        }
+        break;
+    }
+}
+
+static void run(const char *name, enum way way, int write)
+{
+    long batches = total / batch;
+    uint64_t *lat = xmalloc(batches * sizeof(*lat));
+    unsigned int seed = 1;
+    uint64_t start = now_ns();
+
+    for (long k = 0; k < batches; k++) {
+        uint64_t t0;
+
+        for (int i = 0; i < batch; i++) {
+            ext[i].offset = quantum_offset(&seed, span, quantum, bytes);
+            ext[i].result = 0;
+        }
+        t0 = now_ns();
+        do_batch(way, write);
+        lat[k] = now_ns() - t0;
+    }
+
+    printf("%-24s %10.0f extents/s\n", name,
+            batches * batch * 1e9 / (now_ns() - start));
+    report_lat(name, lat, batches);
+    free(lat);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:B:b:s:")) != -1) {
+        switch (opt) {
+        case 'd': dev = optarg; break;
+        case 'n': total = atol(optarg); break;
+        case 'B': batch = atoi(optarg); break;
+        case 'b': bytes = atol(optarg); break;
+        case 's': span = atol(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-d dev] [-n extents] [-B batch] "
+                    "[-b bytes] [-s span]\n", argv[0]);
+            return 1;
+        }
+    }
+    quantum = dev_quantum(dev);
+    if (batch <= 0 || batch > SCULL_MAX_EXTENTS || !bytes || bytes > quantum ||
+            span < bytes || total < batch) {
+        fprintf(stderr, "need 0 < batch <= %d, batch <= extents, "
+                "0 < bytes <= quantum (%d) and bytes <= span\n",
+                SCULL_MAX_EXTENTS, quantum);
+        return 1;
+    }
+
+    fd = open(dev, O_RDWR);
+    if (fd < 0)
+        die(dev);
+    fill_dev(fd, span, 'f');           /* so that reads find data */
+
+    ext = xmalloc(batch * sizeof(*ext));
+    bufs = xmalloc(batch * bytes);
+    memset(bufs, 'b', batch * bytes);
+    for (int i = 0; i < batch; i++) {
+        ext[i].addr = (uintptr_t)(bufs + i * bytes);
+        ext[i].len = bytes;
+    }
+    uring_init(&r, batch);
+
+    printf("%s: %ld extents of %zu bytes over %zu, %d per batch\n",
+            dev, total, bytes, span, batch);
+    run("pwrite", SYSCALLS, 1);
+    run("io_uring write", URING, 1);
+    run("SCULL_IOCWRITEV", IOCTL, 1);
+    run("uring_cmd WRITEV", URING_CMD, 1);
+    run("pread", SYSCALLS, 0);
+    run("io_uring read", URING, 0);
+    run("SCULL_IOCREADV", IOCTL, 0);
+    run("uring_cmd READV", URING_CMD, 0);
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * How often io_uring completes scull reads and writes inline, on the
+ * IOCB_NOWAIT attempt, and the latency that saves over the worker thread
+ * the request is punted to otherwise (forced here with IOSQE_ASYNC).  A
+ * request counts as inline when its completion is already posted by the
+ * time io_uring_enter() returns from submitting it.  Contending threads
+ * doing pwrite() on the same device make some attempts find dev->sem
+ * held, and fall back to a worker.  No request crosses a quantum, so that
+ * each one moves all its bytes.
+ *
+ *   uring_nowait [-d dev] [-n ops] [-b bytes] [-s span] [-c contenders]
+ */
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "uring.h"
+
+static const char *dev = "/dev/scull0";
+static long ops = 100000;
+static size_t bytes = 512;
+static size_t span = 1 << 20;
+static int contenders;
+
+static int fd, quantum;
+static volatile int stop;
+
+static void *contend(void *arg)
+{
+    char *buf = xmalloc(bytes);
+    unsigned int seed = (uintptr_t)arg;
+
+    memset(buf, 'c', bytes);
+    while (!stop) {
+        if (pwrite(fd, buf, bytes, quantum_offset(&seed, span, quantum, bytes)) < 0)
+            die("pwrite");
+    }
+    free(buf);
+    return NULL;
+}
+
+static void run(struct uring *r, const char *name, int opcode, int flags)
+{
+    uint64_t *lat = xmalloc(ops * sizeof(*lat));
+    char *buf = xmalloc(bytes);
+    unsigned int seed = 1;
+    long inline_done = 0, errors = 0;
+
+    memset(buf, 'u', bytes);
+    for (long i = 0; i < ops; i++) {
+        struct io_uring_sqe *sqe = uring_sqe(r);
+        struct io_uring_cqe cqe;
+        uint64_t t0;
+
+        sqe->opcode = opcode;
+        sqe->flags = flags;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = bytes;
+        sqe->off = quantum_offset(&seed, span, quantum, bytes);
+
+        t0 = now_ns();
+        uring_submit(r, 0);
+        if (uring_peek(r, &cqe))
+            inline_done++;
+        else
+            uring_wait(r, &cqe);
+        lat[i] = now_ns() - t0;
+        if (cqe.res != (int)bytes)
+            errors++;
+    }
+
+    printf("%-24s %6.2f%% inline, %ld errors\n", name,
+            100.0 * inline_done / ops, errors);
+    report_lat(name, lat, ops);
+    free(buf);
+    free(lat);
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t *threads;
+    struct uring r;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:b:s:c:")) != -1) {
+        switch (opt) {
+        case 'd': dev = optarg; break;
+        case 'n': ops = atol(optarg); break;
+        case 'b': bytes = atol(optarg); break;
+        case 's': span = atol(optarg); break;
+        case 'c': contenders = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-d dev] [-n ops] [-b bytes] [-s span] "
+                    "[-c contenders]\n", argv[0]);
+            return 1;
+        }
+    }
+    quantum = dev_quantum(dev);
+    if (!bytes || bytes > quantum || span < bytes || ops <= 0) {
+        fprintf(stderr, "need 0 < bytes <= quantum (%d), bytes <= span and ops > 0\n",
+                quantum);
+        return 1;
+    }
+
+    fd = open(dev, O_RDWR);
+    if (fd < 0)
+        die(dev);
+    fill_dev(fd, span, 'f');           /* so that reads find data */
+
+    threads = xmalloc((contenders + 1) * sizeof(*threads));
+    for (int i = 0; i < contenders; i++)
+        if (pthread_create(&threads[i], NULL, contend, (void *)(uintptr_t)(i + 2)))
+            die("pthread_create");
+
+    uring_init(&r, 8);
+    printf("%s: %ld ops of %zu bytes over %zu, %d contenders\n",
+            dev, ops, bytes, span, contenders);
+    run(&r, "write, nowait first", IORING_OP_WRITE, 0);
+    run(&r, "write, IOSQE_ASYNC", IORING_OP_WRITE, IOSQE_ASYNC);
+    run(&r, "read, nowait first", IORING_OP_READ, 0);
+    run(&r, "read, IOSQE_ASYNC", IORING_OP_READ, IOSQE_ASYNC);
+
+    stop = 1;
+    for (int i = 0; i < contenders; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,473 @@
+/*
+ * log.c -- broadcast log driver for scull
+ *
+ * One stream, many independent consumers: writes append to a bounded
+ * log, every open file reads it through its own cursor, at its own pace,
+ * and a byte is only released once the slowest reader has passed it (or
+ * the retention limit says it must go).  The data is held once, in a
+ * single ring shared by all readers.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk(), min() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/vmalloc.h>	/* vmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/fcntl.h>
+#include <linux/poll.h>
+#include <linux/cdev.h>
+#include <linux/device.h>	/* device_create() */
+#include <linux/sched/signal.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/log2.h>		/* roundup_pow_of_two() */
+
+#include <linux/uaccess.h>	/* copy_*_user */
+
+#include "scull.h"
+
+/*
+ * Positions are byte counts since the log was created, so they never wrap;
+ * the ring index is the position masked with buffersize - 1.  Everything
+ * in [tail, head) is still held.  Readers copy out of the ring without
+ * holding any lock: a writer only ever reuses space behind the tail, and
+ * the tail is never moved past a reader that is busy copying.
+ */
+struct scull_log {
+    wait_queue_head_t inq, outq;    /* read and write queues */
+    char *buffer;                   /* the ring */
+    unsigned int buffersize;        /* a power of two */
+    unsigned int cap;               /* max bytes held: retention or buffersize */
+    u64 head;                       /* next byte to be written */
+    u64 tail;                       /* oldest byte still held */
+    struct list_head readers;       /* scull_l_reader cursors */
+    spinlock_t lock;                /* protects head, tail and the cursors */
+    int nreaders, nwriters;         /* number of openings for r/w */
+    struct mutex wlock;             /* serializes writers */
+    struct semaphore sem;           /* protects open/release bookkeeping */
+    struct cdev cdev;               /* Char device structure */
+};
+
+/* Per-open-file state: one cursor per reader */
+struct scull_l_reader {
+    struct scull_log *dev;
+    struct list_head list;          /* on dev->readers */
+    struct mutex mutex;             /* threads sharing the file take turns */
+    u64 cursor;                     /* next byte this reader gets */
+    u64 dropped;                    /* bytes lost to the retention limit */
+    bool busy;                      /* copying out of the ring right now */
+};
+
+/* parameters */
+static int scull_l_nr_devs = SCULL_L_NR_DEVS;  /* number of log devices */
+int scull_l_buffer = SCULL_L_BUFFER;           /* ring size */
+static int scull_l_retention;                  /* 0: writers wait for readers */
+static dev_t scull_l_devno;                    /* Our first device number */
+
+module_param(scull_l_nr_devs, int, S_IRUGO);
+module_param(scull_l_buffer, int, S_IRUGO);
+module_param(scull_l_retention, int, S_IRUGO);
+
+static struct scull_log *scull_l_devices;
+
+/*
+ * Open and close
+ */
+static int scull_l_open(struct inode *inode, struct file *filp)
+{
+    struct scull_log *dev;
+    struct scull_l_reader *rd;
+
+    dev = container_of(inode->i_cdev, struct scull_log, cdev);
+
+    rd = kzalloc(sizeof(*rd), GFP_KERNEL);
+    if (!rd)
+        return -ENOMEM;
+    rd->dev = dev;
+    INIT_LIST_HEAD(&rd->list);
+    mutex_init(&rd->mutex);
+    filp->private_data = rd;
+
+    if (down_interruptible(&dev->sem)) {
+        kfree(rd);
+        return -ERESTARTSYS;
+    }
+    if (!dev->buffer) {
+        /* allocate the ring */
+        dev->buffer = vmalloc(scull_l_buffer);
+        if (!dev->buffer) {
+            up(&dev->sem);
+            kfree(rd);
+            return -ENOMEM;
+        }
+        dev->buffersize = scull_l_buffer;
+        dev->cap = scull_l_retention ?
+            min_t(unsigned int, scull_l_retention, dev->buffersize) : dev->buffersize;
+        dev->head = dev->tail = 0;
+    }
+
+    /* use f_mode, not f_flags: it's cleaner (fs/open.c tells why) */
+    if (filp->f_mode & FMODE_READ) {
+        dev->nreaders++;
+        spin_lock(&dev->lock);
+        rd->cursor = dev->tail;        /* start with everything still held */
+        list_add(&rd->list, &dev->readers);
+        spin_unlock(&dev->lock);
+    }
+    if (filp->f_mode & FMODE_WRITE)
+        dev->nwriters++;
+    up(&dev->sem);
+
+    return nonseekable_open(inode, filp);
+}
+
+static int scull_l_release(struct inode *inode, struct file *filp)
+{
+    struct scull_l_reader *rd = filp->private_data;
+    struct scull_log *dev = rd->dev;
+
+    down(&dev->sem);
+    if (filp->f_mode & FMODE_READ) {
+        dev->nreaders--;
+        spin_lock(&dev->lock);
+        list_del(&rd->list);
+        spin_unlock(&dev->lock);
+        wake_up_interruptible(&dev->outq); /* it may have been the slowest */
+    }
+    if (filp->f_mode & FMODE_WRITE)
+        dev->nwriters--;
+    if (dev->nreaders + dev->nwriters == 0) {
+        vfree(dev->buffer);
+        dev->buffer = NULL; /* the other fields are not checked on open */
+    }
+    up(&dev->sem);
+    kfree(rd);
+    return 0;
+}
+
+/*
+ * Whether there is room for "count" more bytes, or the tail can be moved
+ * far enough to make it.  The tail cannot pass a reader's cursor; with a
+ * retention limit, idle readers that lag that far behind can be dragged
+ * along, without one the writer has to wait for them.  Busy readers are
+ * always waited for.  Only looks, so that it can be a wait condition.
+ * Called with dev->lock held.
+ */
+static bool scull_l_room(struct scull_log *dev, size_t count)
+{
+    struct scull_l_reader *rd;
+    u64 need = dev->head + count;
+
+    if (need <= dev->tail + dev->cap)
+        return true;
+    need -= dev->cap;
+
+    list_for_each_entry(rd, &dev->readers, list) {
+        if (rd->cursor < need && (rd->busy || !scull_l_retention))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Make room for "count" more bytes, if scull_l_room() says it can be
+ * made, by moving the tail and dragging the readers it passes along (and
+ * telling them how much they lost).  Only a writer holding dev->wlock may
+ * do that.  Called with dev->lock held.
+ */
+static bool scull_l_make_room(struct scull_log *dev, size_t count)
+{
+    struct scull_l_reader *rd;
+    u64 need = dev->head + count;
+
+    if (!scull_l_room(dev, count))
+        return false;
+    if (need <= dev->tail + dev->cap)
+        return true;
+    need -= dev->cap;
+
+    list_for_each_entry(rd, &dev->readers, list) {
+        if (rd->cursor < need) {
+            rd->dropped += need - rd->cursor;
+            rd->cursor = need;
+        }
+    }
+    dev->tail = need;
+    return true;
+}
+
+/* Move the tail up to the slowest reader, if the readers moved on */
+static void scull_l_release_tail(struct scull_log *dev)
+{
+    struct scull_l_reader *rd;
+    u64 tail = dev->head;
+
+    list_for_each_entry(rd, &dev->readers, list)
+        tail = min(tail, rd->cursor);
+    if (list_empty(&dev->readers))
+        return;                        /* keep it for the next reader */
+    dev->tail = max(dev->tail, tail);
+}
+
+static bool scull_l_has_room(struct scull_log *dev, size_t count)
+{
+    bool room;
+
+    spin_lock(&dev->lock);
+    room = scull_l_room(dev, count);
+    spin_unlock(&dev->lock);
+    return room;
+}
+
+static bool scull_l_has_data(struct scull_l_reader *rd)
+{
+    struct scull_log *dev = rd->dev;
+    bool data;
+
+    spin_lock(&dev->lock);
+    data = rd->cursor != dev->head;
+    spin_unlock(&dev->lock);
+    return data;
+}
+
+/*
+ * Data management: read and write
+ */
+static ssize_t scull_l_read(struct file *filp, char __user *buf, size_t count,
+        loff_t *f_pos)
+{
+    struct scull_l_reader *rd = filp->private_data;
+    struct scull_log *dev = rd->dev;
+    unsigned int off, l;
+    ssize_t retval;
+    u64 cursor;
+
+    if (mutex_lock_interruptible(&rd->mutex))
+        return -ERESTARTSYS;
+
+    for (;;) {
+        spin_lock(&dev->lock);
+        if (rd->cursor != dev->head)
+            break;
+        spin_unlock(&dev->lock);
+        retval = -EAGAIN;
+        if (filp->f_flags & O_NONBLOCK)
+            goto out;
+        retval = -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+        if (wait_event_interruptible(dev->inq, scull_l_has_data(rd)))
+            goto out;
+    }
+    /* pin our part of the ring, then copy it out without the lock */
+    cursor = rd->cursor;
+    count = min_t(u64, count, dev->head - cursor);
+    rd->busy = true;
+    spin_unlock(&dev->lock);
+
+    off = cursor & (dev->buffersize - 1);
+    l = min_t(size_t, count, dev->buffersize - off);
+    retval = count;
+    if (copy_to_user(buf, dev->buffer + off, l) ||
+            copy_to_user(buf + l, dev->buffer, count - l))
+        retval = -EFAULT;
+
+    spin_lock(&dev->lock);
+    rd->busy = false;
+    if (retval > 0)
+        rd->cursor += retval;
+    scull_l_release_tail(dev);
+    spin_unlock(&dev->lock);
+
+    /* finally, awake any writers and return */
+    wake_up_interruptible(&dev->outq);
+out:
+    mutex_unlock(&rd->mutex);
+    return retval;
+}
+
+static ssize_t scull_l_write(struct file *filp, const char __user *buf,
+        size_t count, loff_t *f_pos)
+{
+    struct scull_l_reader *rd = filp->private_data;
+    struct scull_log *dev = rd->dev;
+    unsigned int off, l;
+    bool room;
+    u64 head;
+
+    if (mutex_lock_interruptible(&dev->wlock))
+        return -ERESTARTSYS;
+
+    /* Make sure there's room: a write never holds more than "cap" */
+    count = min_t(size_t, count, dev->cap);
+    for (;;) {
+        spin_lock(&dev->lock);
+        room = scull_l_make_room(dev, count);
+        spin_unlock(&dev->lock);
+        if (room)
+            break;
+        mutex_unlock(&dev->wlock);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->outq, scull_l_has_room(dev, count)))
+            return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+        if (mutex_lock_interruptible(&dev->wlock))
+            return -ERESTARTSYS;
+    }
+
+    /* the space after head is behind the tail: no reader looks at it */
+    head = dev->head;
+    off = head & (dev->buffersize - 1);
+    l = min_t(size_t, count, dev->buffersize - off);
+    if (copy_from_user(dev->buffer + off, buf, l) ||
+            copy_from_user(dev->buffer, buf + l, count - l)) {
+        mutex_unlock(&dev->wlock);
+        return -EFAULT;
+    }
+
+    spin_lock(&dev->lock);
+    dev->head = head + count;
+    spin_unlock(&dev->lock);
+    mutex_unlock(&dev->wlock);
+
+    /* finally, awake the readers */
+    wake_up_interruptible(&dev->inq);
+    return count;
+}
+
+static __poll_t scull_l_poll(struct file *filp, poll_table *wait)
+{
+    struct scull_l_reader *rd = filp->private_data;
+    struct scull_log *dev = rd->dev;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &dev->inq,  wait);
+    poll_wait(filp, &dev->outq, wait);
+    if ((filp->f_mode & FMODE_READ) && scull_l_has_data(rd))
+        mask |= EPOLLIN | EPOLLRDNORM;   /* readable */
+
+    /* don't drop anything just for poll: only look at the slowest reader */
+    spin_lock(&dev->lock);
+    scull_l_release_tail(dev);
+    if (scull_l_retention || list_empty(&dev->readers) ||
+            dev->head < dev->tail + dev->cap)
+        mask |= EPOLLOUT | EPOLLWRNORM;  /* writable */
+    spin_unlock(&dev->lock);
+    return mask;
+}
+
+/*
+ * The ioctl() implementation: how much has this reader lost to the
+ * retention limit?
+ */
+static long scull_l_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_l_reader *rd = filp->private_data;
+    struct scull_log *dev = rd->dev;
+    u64 dropped;
+
+    if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
+    if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
+
+    switch (cmd) {
+    case SCULL_L_IOCGDROPPED: /* Get: arg is pointer to result */
+        spin_lock(&dev->lock);
+        dropped = rd->dropped;
+        spin_unlock(&dev->lock);
+        return put_user(dropped, (u64 __user *)arg);
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * The file operations for the log device
+ */
+struct file_operations scull_log_fops = {
+    .owner = THIS_MODULE,
+    .read = scull_l_read,
+    .write = scull_l_write,
+    .poll = scull_l_poll,
+    .unlocked_ioctl = scull_l_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .open = scull_l_open,
+    .release = scull_l_release,
+};
+
+/*
+ * Set up a cdev entry.
+ */
+static void scull_l_setup_cdev(struct scull_log *dev, int index)
+{
+    int err, devno = scull_l_devno + index;
+
+    cdev_init(&dev->cdev, &scull_log_fops);
+    dev->cdev.owner = THIS_MODULE;
+    err = cdev_add(&dev->cdev, devno, 1);
+    /* Fail gracefully if need be */
+    if (err)
+        printk(KERN_NOTICE "Error %d adding scullog%d", err, index);
+    else
+        device_create(scull_class, NULL, devno, NULL, "scullog%d", index);
+}
+
+/*
+ * Initialize the log devs; return how many we did.
+ */
+int scull_l_init(dev_t firstdev)
+{
+    int result;
+
+    if (scull_l_buffer < 1 || scull_l_retention < 0) {
+        printk(KERN_WARNING "scull: bad scull_l_buffer or scull_l_retention\n");
+        return 0;
+    }
+    scull_l_buffer = roundup_pow_of_two(scull_l_buffer); /* for the ring masks */
+
+    result = register_chrdev_region(firstdev, scull_l_nr_devs, "scullog");
+    if (result < 0) {
+        printk(KERN_NOTICE "Unable to get scullog region, error %d\n", result);
+        return 0;
+    }
+    scull_l_devno = firstdev;
+    scull_l_devices = kmalloc(scull_l_nr_devs * sizeof(struct scull_log), GFP_KERNEL);
+    if (scull_l_devices == NULL) {
+        unregister_chrdev_region(firstdev, scull_l_nr_devs);
+        return 0;
+    }
+    memset(scull_l_devices, 0, scull_l_nr_devs * sizeof(struct scull_log));
+    for (int i = 0; i < scull_l_nr_devs; i++) {
+        init_waitqueue_head(&(scull_l_devices[i].inq));
+        init_waitqueue_head(&(scull_l_devices[i].outq));
+        INIT_LIST_HEAD(&scull_l_devices[i].readers);
+        spin_lock_init(&scull_l_devices[i].lock);
+        mutex_init(&scull_l_devices[i].wlock);
+        sema_init(&scull_l_devices[i].sem, 1);
+        scull_l_setup_cdev(scull_l_devices + i, i);
+    }
+    return scull_l_nr_devs;
+}
+
+/*
+ * This is called by cleanup_module or on failure.
+ * It is required to never fail, even if nothing was initialized first
+ */
+void scull_l_cleanup(void)
+{
+    if (!scull_l_devices)
+        return; /* nothing else to release */
+
+    for (int i = 0; i < scull_l_nr_devs; i++) {
+        device_destroy(scull_class, scull_l_devno + i);
+        cdev_del(&scull_l_devices[i].cdev);
+        vfree(scull_l_devices[i].buffer);
+    }
+    kfree(scull_l_devices);
+    unregister_chrdev_region(scull_l_devno, scull_l_nr_devs);
+    scull_l_devices = NULL; /* pedantic */
+}
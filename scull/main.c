@@ -0,0 +1,2078 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/proc_fs.h>
+#include <linux/fcntl.h>	/* O_ACCMODE */
+#include <linux/seq_file.h>
+#include <linux/cdev.h>
+#include <linux/device.h>	/* class_create(), struct device */
+#include <linux/miscdevice.h>
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>	/* call_rcu() */
+#include <linux/srcu.h>
+#include <linux/mm.h>		/* kvzalloc_node(), page_to_nid() */
+#include <linux/nodemask.h>	/* next_node_in() */
+#include <linux/numa.h>		/* NUMA_NO_NODE */
+#include <linux/capability.h>
+#include <linux/pagemap.h>	/* fault_in_*() */
+#include <linux/uio.h>		/* struct iov_iter */
+#include <linux/io_uring/cmd.h>	/* struct io_uring_cmd */
+#include <linux/sort.h>
+#include <linux/percpu.h>	/* this_cpu_add() */
+#include <linux/sched/clock.h>	/* local_clock() */
+#include <linux/math64.h>	/* div_u64() */
+#include <linux/workqueue.h>
+
+#include <linux/uaccess.h>	/* copy_*_user */
+
+#include "scull.h"
+
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+
+MODULE_AUTHOR("Tan Yu Peng");
+MODULE_LICENSE("GPL");
+
+int scull_major =   SCULL_MAJOR;
+int scull_minor =   0;
+int scull_nr_devs = SCULL_NR_DEVS;	/* bare scull devices created at load */
+int scull_quantum = SCULL_QUANTUM;
+int scull_qset =    SCULL_QSET;
+int scull_node =    NUMA_NO_NODE;	/* of the devices created at load */
+
+module_param(scull_major, int, S_IRUGO);
+module_param(scull_minor, int, S_IRUGO);
+module_param(scull_nr_devs, int, S_IRUGO);
+module_param(scull_quantum, int, S_IRUGO);
+module_param(scull_qset, int, S_IRUGO);
+module_param(scull_node, int, S_IRUGO);
+
+/* Lock contention profiling, in debugfs; cheap enough to leave on */
+static bool scull_lock_stats = true;
+module_param(scull_lock_stats, bool, S_IRUGO | S_IWUSR);
+
+struct class *scull_class;		/* all our devices, in /sys/class/scull */
+
+/*
+ * The bare devices, each in its own cache lines so that neighbours never
+ * false-share their semaphores and sizes, and on its own NUMA node.
+ */
+static struct kmem_cache *scull_dev_cache;
+
+/* Readers of the per-node replicas, which may fault and so sleep */
+DEFINE_STATIC_SRCU(scull_srcu);
+
+/* Freezes that a close must not wait for */
+static struct workqueue_struct *scull_wq;
+
+/* ---------------------- helper functions ---------------------- */
+
+/*
+ * Statistics: plain per-CPU adds, with no lock and no shared cache line;
+ * stats.c sums them up.
+ */
+static inline void scull_stat_add(struct scull_dev *dev, enum scull_stat i, u64 n)
+{
+    this_cpu_add(dev->stats->count[i], n);
+}
+
+static inline void scull_hist_add(struct scull_dev *dev, enum scull_hist h, u64 ns)
+{
+    this_cpu_inc(dev->stats->hist[h][min(fls64(ns), SCULL_HIST_BUCKETS - 1)]);
+}
+
+/* ---------------------- replicas ---------------------- */
+
+static void scull_replica_free(struct scull_replica *rep)
+{
+    for (int node = 0; node < nr_node_ids; node++) {
+        if (!rep->quanta[node])
+            continue;
+        for (unsigned long i = 0; i < rep->nr_quanta; i++)
+            kfree(rep->quanta[node][i]);
+        kvfree(rep->quanta[node]);
+    }
+    kfree(rep);
+}
+
+static void scull_replica_free_rcu(struct rcu_head *rcu)
+{
+    scull_replica_free(container_of(rcu, struct scull_replica, rcu));
+}
+
+/*
+ * Drop the replicas before the data changes; dev->sem must be held.
+ * Readers already on a copy finish with it, concurrently with the change,
+ * and it is freed after them; later readers take dev->sem again.  The
+ * change is counted in dev->data_gen, for a freeze copying the data
+ * without the semaphore to notice it.
+ */
+static void scull_unfreeze(struct scull_dev *dev)
+{
+    struct scull_replica *rep = rcu_dereference_protected(dev->replica, true);
+
+    dev->data_gen++;
+    if (!rep)
+        return;
+    RCU_INIT_POINTER(dev->replica, NULL);
+    call_srcu(&scull_srcu, &rep->rcu, scull_replica_free_rcu);
+}
+
+int scull_trim(struct scull_dev *dev)
+{
+    struct scull_qset *next, *dptr;
+    int qset = dev->qset;                       /* "dev" is not-null */
+
+    scull_unfreeze(dev);
+    trace_scull_trim(dev);
+    for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
+        if (dptr->data) {
+            for (int i = 0; i < qset; i++) {
+                if (dptr->data[i])
+                    trace_scull_quantum_free(dev, dptr->data[i], dev->quantum);
+                kfree(dptr->data[i]);
+            }
+            kfree(dptr->data);
+            dptr->data = NULL;
+        }
+        next = dptr->next;
+        kfree(dptr);
+    }
+
+    dev->size = 0;
+    WRITE_ONCE(dev->nr_qsets, 0);
+    WRITE_ONCE(dev->nr_quanta, 0);
+    WRITE_ONCE(dev->nr_arrays, 0);
+    for (int i = 0; i < SCULL_FILL_BUCKETS; i++)
+        WRITE_ONCE(dev->fill_hist[i], 0);
+    for (int i = 0; i < nr_node_ids; i++)
+        WRITE_ONCE(dev->node_quanta[i], 0);
+    dev->data = NULL;
+    dev->last_qs = NULL;
+
+    return 0;
+}
+
+/*
+ * Move a list node from one fullness bucket to another, as it goes from
+ * "from" to "to" populated quanta ("from" < 0: the node is new).
+ */
+static void scull_fill_move(struct scull_dev *dev, int from, int to)
+{
+    int qset = dev->qset;
+
+    if (from >= 0) {
+        int b = DIV_ROUND_UP(from * (SCULL_FILL_BUCKETS - 1), qset);
+
+        WRITE_ONCE(dev->fill_hist[b], dev->fill_hist[b] - 1);
+    }
+    to = DIV_ROUND_UP(to * (SCULL_FILL_BUCKETS - 1), qset);
+    WRITE_ONCE(dev->fill_hist[to], dev->fill_hist[to] + 1);
+}
+
+/*
+ * Follow the list.  Where it ends, spare nodes from "pa" are appended; if
+ * there are not enough of them (or "pa" is NULL, as for readers) NULL is
+ * returned, and pa->need_qs tells the writer how many more to allocate
+ * before retrying.  The walk resumes from the node found last time when
+ * that is on the way, so sequential access (and a batch sorted by offset)
+ * only traverses the list once.
+ */
+struct scull_qset *scull_follow(struct scull_dev *dev, int n, struct scull_prealloc *pa)
+{
+    struct scull_qset **qsp = &dev->data;
+    struct scull_qset *qs = NULL;
+    int i = 0;
+
+    if (dev->last_qs && dev->last_item <= n) {
+        qs = dev->last_qs;
+        qsp = &qs->next;
+        i = dev->last_item + 1;
+    }
+    if (n >= i)
+        scull_stat_add(dev, SCULL_STAT_FOLLOW_HOPS, n - i + 1);
+    trace_scull_follow(dev, n, max(n - i + 1, 0));
+
+    for (; i <= n; i++) {
+        if (!*qsp) {
+            if (!pa || !pa->qs) {
+                if (pa)
+                    pa->need_qs = n - i + 1;
+                return NULL;
+            }
+            *qsp = pa->qs;             /* install a spare node */
+            pa->qs = pa->qs->next;
+            (*qsp)->next = NULL;
+            WRITE_ONCE(dev->nr_qsets, dev->nr_qsets + 1);
+            scull_fill_move(dev, -1, 0);
+        }
+        qs = *qsp;
+        qsp = &qs->next;
+    }
+
+    dev->last_qs = qs;
+    dev->last_item = n;
+    return qs;
+}
+
+/*
+ * Guess, without the lock, what writing [pos, pos + len) is going to need:
+ * every quantum past the last allocated one, the pointer arrays of the
+ * list nodes past the last one holding data, and the list nodes past the
+ * end of the list.  A batch calls this for each extent in offset order;
+ * pa->guess_q and guess_item keep anything from being counted twice, and
+ * it stops SCULL_PREALLOC_MAX quanta ahead.  A wrong guess only costs an
+ * extra round trip through the semaphore.
+ */
+static void scull_prealloc_guess(struct scull_dev *dev, loff_t pos, size_t len,
+        struct scull_prealloc *pa)
+{
+    unsigned long size = READ_ONCE(dev->size);
+    int quantum = READ_ONCE(dev->quantum), qset = READ_ONCE(dev->qset);
+    long itemsize = (long)quantum * qset;
+    long first, last, first_item, last_item;
+
+    if (!len)
+        return;
+
+    /* quanta below the size are most likely there already */
+    first = max3((long)pos / quantum, (long)DIV_ROUND_UP(size, quantum), pa->guess_q);
+    last = (long)(pos + len - 1) / quantum;
+    last = min(last, first + SCULL_PREALLOC_MAX - 1 - pa->need_quanta);
+    if (first > last)
+        return;
+    pa->need_quanta += last - first + 1;
+    pa->guess_q = last + 1;
+
+    first_item = max3(first / qset, (long)DIV_ROUND_UP(size, itemsize), pa->guess_item);
+    last_item = last / qset;
+    if (first_item <= last_item) {
+        pa->need_data += last_item - first_item + 1;
+        pa->guess_item = last_item + 1;
+    }
+    pa->need_qs = max_t(long, pa->need_qs, last_item + 1 - READ_ONCE(dev->nr_qsets));
+}
+
+/*
+ * The node the next quantum of a device goes to.  NUMA_NO_NODE, a device
+ * created with no node, means the writer's, as with plain kmalloc().
+ */
+static int scull_quantum_node(struct scull_dev *dev)
+{
+    int node;
+
+    switch (READ_ONCE(dev->policy)) {
+    case SCULL_PLACE_LOCAL:
+        return numa_node_id();
+    case SCULL_PLACE_INTERLEAVE:
+        /* racing writers may both pick the same node; no harm done */
+        node = next_node_in(READ_ONCE(dev->next_node), node_states[N_MEMORY]);
+        WRITE_ONCE(dev->next_node, node);
+        return node;
+    default:                           /* FIXED, REPLICATE */
+        return dev_to_node(&dev->dev);
+    }
+}
+
+/* Free the spares that only fit the geometry they were allocated for */
+static void scull_prealloc_drop(struct scull_prealloc *pa)
+{
+    void **next;
+
+    for (; pa->data; pa->data = next) {
+        next = pa->data[0];
+        kfree(pa->data);
+    }
+    while (pa->nr_quanta)
+        kfree(pa->quanta[--pa->nr_quanta]);
+}
+
+/*
+ * Allocate what the guesses and the last attempt found missing.  Called
+ * without dev->sem, so GFP_KERNEL and its direct reclaim only ever stall
+ * this writer; non-blocking writers pass GFP_NOWAIT instead.
+ */
+static int scull_prealloc_fill(struct scull_dev *dev, struct scull_prealloc *pa,
+        int quantum, int qset, gfp_t gfp)
+{
+    if (!pa->quanta) {
+        pa->quanta = pa->inline_quanta;
+        pa->max_quanta = SCULL_PREALLOC_INLINE;
+    }
+    if (pa->qset != qset || pa->quantum_size != quantum) {
+        scull_prealloc_drop(pa);       /* geometry changed, spares are useless */
+        pa->qset = qset;
+        pa->quantum_size = quantum;
+    }
+
+    for (; pa->need_qs > 0; pa->need_qs--) {
+        struct scull_qset *qs = kmalloc_node(sizeof(struct scull_qset), gfp,
+                dev_to_node(&dev->dev));
+
+        if (!qs)
+            goto nomem;
+        scull_stat_add(dev, SCULL_STAT_ALLOCS, 1);
+        memset(qs, 0, sizeof(struct scull_qset));
+        qs->next = pa->qs;
+        pa->qs = qs;
+    }
+
+    for (; pa->need_data > 0; pa->need_data--) {
+        void **data = kmalloc_node(qset * sizeof(char *), gfp, dev_to_node(&dev->dev));
+
+        if (!data)
+            goto nomem;
+        scull_stat_add(dev, SCULL_STAT_ALLOCS, 1);
+        memset(data, 0, qset * sizeof(char *));
+        data[0] = pa->data;
+        pa->data = data;
+    }
+
+    if (pa->need_quanta > pa->max_quanta - pa->nr_quanta) {
+        int max = pa->nr_quanta + pa->need_quanta;
+        void **quanta = kmalloc_array(max, sizeof(void *), gfp);
+
+        if (!quanta)
+            goto nomem;
+        memcpy(quanta, pa->quanta, pa->nr_quanta * sizeof(void *));
+        if (pa->quanta != pa->inline_quanta)
+            kfree(pa->quanta);
+        pa->quanta = quanta;
+        pa->max_quanta = max;
+    }
+    /*
+     * Zeroed: what a quantum is installed with is readable below the size,
+     * be it the head of a quantum a write starts into, or a preallocation.
+     */
+    for (; pa->need_quanta > 0; pa->need_quanta--) {
+        void *quantum_p = kmalloc_node(quantum, gfp | __GFP_ZERO,
+                scull_quantum_node(dev));
+
+        if (!quantum_p)
+            goto nomem;
+        scull_stat_add(dev, SCULL_STAT_ALLOCS, 1);
+        pa->quanta[pa->nr_quanta++] = quantum_p;
+    }
+
+    return 0;
+
+nomem:
+    scull_stat_add(dev, SCULL_STAT_ALLOC_FAILS, 1);
+    return -ENOMEM;
+}
+
+/* Free the spares nobody installed (another writer won the race) */
+static void scull_prealloc_free(struct scull_prealloc *pa)
+{
+    struct scull_qset *next;
+
+    for (; pa->qs; pa->qs = next) {
+        next = pa->qs->next;
+        kfree(pa->qs);
+    }
+    scull_prealloc_drop(pa);
+    if (pa->quanta != pa->inline_quanta)
+        kfree(pa->quanta);             /* fine if NULL */
+}
+
+/*
+ * Copy to and from user space with page faults disabled.  dev->sem must
+ * never be held across a page fault: a non-resident user buffer would keep
+ * every other opener of the device waiting on swap-in.  Callers fault the
+ * buffer in before taking the semaphore, and retry if it went away again
+ * in the meantime.  Return the number of bytes copied.
+ */
+static size_t scull_copy_to_iter_nofault(const void *from, size_t n,
+        struct iov_iter *to)
+{
+    size_t copied;
+
+    pagefault_disable();
+    copied = copy_to_iter(from, n, to);
+    pagefault_enable();
+    return copied;
+}
+
+static size_t scull_copy_from_iter_nofault(void *to, size_t n,
+        struct iov_iter *from)
+{
+    size_t copied;
+
+    pagefault_disable();
+    copied = copy_from_iter(to, n, from);
+    pagefault_enable();
+    return copied;
+}
+
+/*
+ * IOCB_NOWAIT (io_uring's first, inline attempt) callers must not sleep at
+ * all: they only trylock dev->sem, never fault the user buffer in and never
+ * enter reclaim, and get -EAGAIN whenever one of those would have been
+ * needed.  O_NONBLOCK callers must not wait for the semaphore or for
+ * reclaim either, but may fault: a page fault is not "blocking" in that
+ * sense, and they would have nothing to wait on before retrying.
+ */
+static inline bool scull_nowait(struct kiocb *iocb)
+{
+    return iocb->ki_flags & IOCB_NOWAIT;
+}
+
+static inline bool scull_nonblock(struct kiocb *iocb)
+{
+    return scull_nowait(iocb) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+/*
+ * All of dev->sem goes through these, which time the wait for it and how
+ * long it is held.  "t0" is when the caller started waiting, "ip" where.
+ * With scull_lock_stats, totals go to the per-CPU counters, while the
+ * maxima are plain stores by the holder of the semaphore.
+ */
+static void scull_lock_acquired(struct scull_dev *dev, u64 t0, unsigned long ip)
+{
+    u64 now = local_clock(), waited = now - t0;
+
+    scull_hist_add(dev, SCULL_HIST_LOCK_WAIT, waited);
+    trace_scull_lock(dev, waited);
+    dev->locked_at = now;
+    dev->locked_ip = ip;
+
+    if (READ_ONCE(scull_lock_stats)) {
+        scull_stat_add(dev, SCULL_STAT_LOCK_ACQUIRES, 1);
+        scull_stat_add(dev, SCULL_STAT_LOCK_WAIT_NS, waited);
+        if (waited > dev->lock_max_wait)
+            WRITE_ONCE(dev->lock_max_wait, waited);
+    }
+}
+
+/* Always inlined, so that _THIS_IP_ names the call site */
+static __always_inline int scull_lock(struct scull_dev *dev, bool nowait)
+{
+    u64 t0 = local_clock();
+
+    if (down_trylock(&dev->sem)) {
+        if (READ_ONCE(scull_lock_stats))
+            scull_stat_add(dev, SCULL_STAT_LOCK_CONTENDED, 1);
+        if (nowait)
+            return -EAGAIN;
+        if (down_interruptible(&dev->sem)) {
+            scull_stat_add(dev, SCULL_STAT_RESTARTS, 1);
+            return -ERESTARTSYS;
+        }
+    }
+    scull_lock_acquired(dev, t0, _THIS_IP_);
+    return 0;
+}
+
+/* For what must not be interrupted, like publishing an O_APPEND slice */
+static __always_inline void scull_lock_nofail(struct scull_dev *dev)
+{
+    u64 t0 = local_clock();
+
+    if (down_trylock(&dev->sem)) {
+        if (READ_ONCE(scull_lock_stats))
+            scull_stat_add(dev, SCULL_STAT_LOCK_CONTENDED, 1);
+        down(&dev->sem);
+    }
+    scull_lock_acquired(dev, t0, _THIS_IP_);
+}
+
+static void scull_unlock(struct scull_dev *dev)
+{
+    u64 held = local_clock() - dev->locked_at;
+
+    scull_hist_add(dev, SCULL_HIST_LOCK_HOLD, held);
+    trace_scull_unlock(dev, held);
+
+    if (READ_ONCE(scull_lock_stats)) {
+        scull_stat_add(dev, SCULL_STAT_LOCK_HOLD_NS, held);
+        if (held > dev->lock_max_hold) {
+            WRITE_ONCE(dev->lock_max_hold, held);
+            WRITE_ONCE(dev->lock_max_ip, dev->locked_ip);
+        }
+    }
+    up(&dev->sem);
+}
+
+/*
+ * Take dev->sem with no O_APPEND write in flight, as needed to trim the
+ * device: appenders copy into their slices without the semaphore.  Also
+ * always inlined, for _THIS_IP_ in scull_lock() to name our caller.
+ */
+static __always_inline int scull_lock_idle(struct scull_dev *dev)
+{
+    if (scull_lock(dev, false))
+        return -ERESTARTSYS;
+    while (dev->nappend) {
+        scull_unlock(dev);
+        if (wait_event_interruptible(dev->append_wq, !READ_ONCE(dev->nappend))) {
+            scull_stat_add(dev, SCULL_STAT_RESTARTS, 1);
+            return -ERESTARTSYS;
+        }
+        if (scull_lock(dev, false))
+            return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+/*
+ * Whether the list node holding "pos" has an index scull_follow() can
+ * take.  Writers check first, so that nothing is ever stored beyond it.
+ */
+static bool scull_pos_ok(struct scull_dev *dev, loff_t pos)
+{
+    int itemsize = READ_ONCE(dev->quantum) * READ_ONCE(dev->qset);
+
+    return pos >= 0 && div_u64(pos, itemsize) <= INT_MAX;
+}
+
+/* Whether a failed attempt left scull_prealloc_fill() anything to do */
+static bool scull_prealloc_needed(const struct scull_prealloc *pa)
+{
+    return pa->need_qs > 0 || pa->need_data > 0 || pa->need_quanta > 0;
+}
+
+/*
+ * Find the quantum holding "pos", installing list nodes, pointer array
+ * and quantum from "pa" where they are missing.  Returns NULL if "pa" did
+ * not have what was needed; pa->need_* then tell the caller what to
+ * allocate outside the lock before retrying.  dev->sem must be held.
+ */
+static void *scull_install(struct scull_dev *dev, loff_t pos,
+        struct scull_prealloc *pa)
+{
+    struct scull_qset *dptr;
+    int quantum = dev->quantum, qset = dev->qset;
+    int itemsize = quantum * qset;
+    int item, s_pos, rest, nid;
+
+    /* find linked-list item, quantum set index */
+    item = (long)pos / itemsize;
+    rest = (long)pos % itemsize;
+    s_pos = rest / quantum;
+
+    dptr = scull_follow(dev, item, pa); /* follow the list up to the right position */
+
+    if (dptr == NULL)                  /* ran out of spare list nodes */
+        return NULL;
+
+    if (!dptr->data) {                 /* install array of pointers */
+        if (!pa->data || pa->qset != qset) {
+            pa->need_data = 1;
+            return NULL;
+        }
+        dptr->data = pa->data;
+        pa->data = pa->data[0];        /* the next spare */
+        dptr->data[0] = NULL;
+        WRITE_ONCE(dev->nr_arrays, dev->nr_arrays + 1);
+    }
+
+    if (!dptr->data[s_pos]) {          /* install pointer data (quantum) */
+        if (!pa->nr_quanta || pa->quantum_size != quantum) {
+            pa->need_quanta = 1;
+            return NULL;
+        }
+        dptr->data[s_pos] = pa->quanta[--pa->nr_quanta];
+        trace_scull_quantum_alloc(dev, dptr->data[s_pos], quantum);
+        WRITE_ONCE(dev->nr_quanta, dev->nr_quanta + 1);
+        nid = page_to_nid(virt_to_page(dptr->data[s_pos])); /* where it really went */
+        WRITE_ONCE(dev->node_quanta[nid], dev->node_quanta[nid] + 1);
+        scull_fill_move(dev, dptr->nr_quanta, dptr->nr_quanta + 1);
+        dptr->nr_quanta++;
+    }
+
+    return dptr->data[s_pos];
+}
+
+/*
+ * The bodies of read and write, shared by the read/write entry points and
+ * the batched operations below.  Both move at most up to the end of one
+ * quantum and must be called with dev->sem held.  They return the number
+ * of bytes moved, -EFAULT if the user buffer was not resident, and (write
+ * only) -ENOMEM if a spare from "pa" was missing.
+ */
+static ssize_t scull_read_locked(struct scull_dev *dev, loff_t pos,
+        struct iov_iter *to)
+{
+    struct scull_qset *dptr;
+    int quantum = dev->quantum, qset = dev->qset;
+    int itemsize = quantum * qset;     /* bytes in a quantum set (linked-list node) */
+    int item, s_pos, q_pos, rest;
+    size_t count = iov_iter_count(to), n;
+
+    if (pos >= dev->size)              /* current read position > device size */
+        return 0;
+
+    if (pos + count > dev->size)       /* only read till device size */
+        count = dev->size - pos;
+
+    item = (long)pos / itemsize;       /* which node in linked-list? */
+    rest = (long)pos % itemsize;       /* which data in this node has been read? */
+    s_pos = rest / quantum;            /* index of quantum (array element) in quantum set (array) */
+    q_pos = rest % quantum;            /* offset into quantum (chunk of data) */
+
+    dptr = scull_follow(dev, item, NULL); /* get linked-list node (defined elsewhere) */
+
+    /* don't account for holes, return if data is invalid */
+    if (dptr == NULL || !dptr->data || !dptr->data[s_pos])
+        return 0;
+
+    if (count > quantum - q_pos)       /* read only to the end of this quantum */
+        count = quantum - q_pos;
+
+    n = scull_copy_to_iter_nofault(dptr->data[s_pos] + q_pos, count, to);
+    if (!n && count)
+        return -EFAULT;
+    return n;
+}
+
+/*
+ * Grow dev->size to "end", but not over an O_APPEND slice that is not
+ * published yet, which readers must not see before it is filled: how far
+ * a write went past it is kept in dev->pending_size until then.  Called
+ * with dev->sem held.
+ */
+static void scull_grow_size(struct scull_dev *dev, unsigned long end)
+{
+    unsigned long first;
+
+    if (dev->nappend) {
+        first = list_first_entry(&dev->appends, struct scull_append, list)->pos;
+        if (end > first) {
+            dev->pending_size = max(dev->pending_size, end);
+            end = first;
+        }
+    }
+    if (dev->size < end)
+        dev->size = end;
+}
+
+static ssize_t scull_write_locked(struct scull_dev *dev, loff_t pos,
+        struct iov_iter *from, struct scull_prealloc *pa)
+{
+    int quantum = dev->quantum;
+    int q_pos = (long)pos % quantum;   /* offset into quantum */
+    size_t count = iov_iter_count(from), n;
+    char *data;
+
+    if (!scull_pos_ok(dev, pos))
+        return -EFBIG;
+    scull_unfreeze(dev);
+    data = scull_install(dev, pos, pa);
+    if (!data)
+        return -ENOMEM;
+
+    /* write only up to the end of this quantum */
+    if (count > quantum - q_pos)
+        count = quantum - q_pos;
+
+    n = scull_copy_from_iter_nofault(data + q_pos, count, from);
+    if (!n && count)
+        return -EFAULT;
+
+    /* update the size */
+    scull_grow_size(dev, pos + n);
+    return n;
+}
+
+/* Back "pos" with memory, up to the end of its quantum, without writing */
+static ssize_t scull_alloc_locked(struct scull_dev *dev, loff_t pos,
+        size_t count, struct scull_prealloc *pa)
+{
+    int quantum = dev->quantum;
+    int q_pos = (long)pos % quantum;
+
+    if (!scull_pos_ok(dev, pos))
+        return -EFBIG;
+    scull_unfreeze(dev);               /* holes below the size read as zeros now */
+    if (!scull_install(dev, pos, pa))
+        return -ENOMEM;
+    return min_t(size_t, count, quantum - q_pos);
+}
+
+/*
+ * Copy the data of a device to every node with memory.  Nothing is
+ * allocated under dev->sem: it is only taken to copy each quantum once,
+ * to the first node, and the other nodes copy from there.  If the data
+ * changes meanwhile, which dev->data_gen tells, the device is not
+ * read-only after all and the build gives up with -EAGAIN.  Returns the
+ * replicas or an ERR_PTR(), -ENODATA for a device with no data to copy;
+ * "gen" is the generation they copy.
+ */
+static struct scull_replica *scull_replica_build(struct scull_dev *dev,
+        unsigned long *gen)
+{
+    struct scull_replica *rep;
+    unsigned long size, nr;
+    int quantum, qset, node, retval;
+
+    retval = scull_lock_idle(dev);
+    if (retval)
+        return ERR_PTR(retval);
+    size = dev->size;
+    quantum = dev->quantum;
+    qset = dev->qset;
+    *gen = dev->data_gen;
+    scull_unlock(dev);
+    if (!size)
+        return ERR_PTR(-ENODATA);
+    nr = DIV_ROUND_UP(size, quantum);
+
+    rep = kzalloc(struct_size(rep, quanta, nr_node_ids), GFP_KERNEL);
+    if (!rep)
+        return ERR_PTR(-ENOMEM);
+    rep->size = size;
+    rep->quantum = quantum;
+    rep->nr_quanta = nr;
+    rep->home = first_node(node_states[N_MEMORY]);
+
+    retval = -ENOMEM;
+    for_each_node_state(node, N_MEMORY) {
+        rep->quanta[node] = kvzalloc_node(array_size(nr, sizeof(void *)),
+                GFP_KERNEL, node);
+        if (!rep->quanta[node])
+            goto fail;
+    }
+
+    for (unsigned long i = 0; i < nr; i++) {
+        void *copy = kmalloc_node(quantum, GFP_KERNEL, rep->home);
+        struct scull_qset *dptr;
+        void *data = NULL;
+
+        if (!copy) {
+            retval = -ENOMEM;
+            goto fail;
+        }
+        retval = scull_lock(dev, false);
+        if (retval) {
+            kfree(copy);
+            goto fail;
+        }
+        if (dev->data_gen == *gen) {
+            dptr = scull_follow(dev, i / qset, NULL);
+            if (dptr && dptr->data)
+                data = dptr->data[i % qset];
+            if (data)
+                memcpy(copy, data, quantum);
+        } else {
+            retval = -EAGAIN;
+        }
+        scull_unlock(dev);
+        if (!data)
+            kfree(copy);               /* a hole stays one */
+        else
+            rep->quanta[rep->home][i] = copy;
+        if (retval)
+            goto fail;
+        cond_resched();
+    }
+
+    for (unsigned long i = 0; i < nr; i++) {
+        void *data = rep->quanta[rep->home][i];
+
+        if (!data)
+            continue;
+        for_each_node_state(node, N_MEMORY) {
+            if (node == rep->home)
+                continue;
+            rep->quanta[node][i] = kmalloc_node(quantum, GFP_KERNEL, node);
+            if (!rep->quanta[node][i]) {
+                retval = -ENOMEM;
+                goto fail;
+            }
+            memcpy(rep->quanta[node][i], data, quantum);
+        }
+        cond_resched();
+    }
+    return rep;
+
+fail:
+    scull_replica_free(rep);
+    return ERR_PTR(retval);
+}
+
+/*
+ * Freeze a device: build its replicas, unless it has them already, and
+ * publish them if the data is still the one they copied.
+ */
+static int scull_freeze(struct scull_dev *dev)
+{
+    struct scull_replica *rep;
+    unsigned long gen;
+    int retval;
+
+    if (rcu_access_pointer(dev->replica))
+        return 0;
+    rep = scull_replica_build(dev, &gen);
+    if (IS_ERR(rep))
+        return PTR_ERR(rep);
+
+    retval = scull_lock(dev, false);
+    if (!retval) {
+        if (dev->data_gen != gen) {
+            retval = -EAGAIN;          /* written to meanwhile */
+        } else if (!rcu_access_pointer(dev->replica)) {
+            rcu_assign_pointer(dev->replica, rep);
+            rep = NULL;
+        }
+        scull_unlock(dev);
+    }
+    if (rep)
+        scull_replica_free(rep);
+    return retval;
+}
+
+/* The last writer of a replicated device closed it: freeze it, from here */
+static void scull_freeze_work(struct work_struct *work)
+{
+    struct scull_dev *dev = container_of(work, struct scull_dev, freeze_work);
+
+    scull_freeze(dev);    /* if it fails, readers just take the lock */
+    put_device(&dev->dev);
+}
+
+static int scull_thaw(struct scull_dev *dev)
+{
+    if (scull_lock(dev, false))
+        return -ERESTARTSYS;
+    scull_unfreeze(dev);
+    scull_unlock(dev);
+    return 0;
+}
+
+/*
+ * Read a frozen device from the copy on the reader's node, or the nearest
+ * one with memory: no dev->sem, and as many quanta as the buffer takes.
+ * Called under scull_srcu, so the copy may fault; but not if "nowait".
+ */
+static ssize_t scull_read_replica(struct scull_replica *rep, loff_t pos,
+        struct iov_iter *to, bool nowait)
+{
+    void **quanta = rep->quanta[numa_mem_id()] ? : rep->quanta[rep->home];
+    size_t done = 0;
+
+    while (iov_iter_count(to) && pos < rep->size) {
+        void *data = quanta[(long)pos / rep->quantum];
+        int q_pos = (long)pos % rep->quantum;
+        size_t count, n;
+
+        if (!data)                     /* a hole ends the read, as it does locked */
+            break;
+        count = min_t(size_t, iov_iter_count(to), rep->quantum - q_pos);
+        count = min_t(size_t, count, rep->size - pos);
+        n = nowait ? scull_copy_to_iter_nofault(data + q_pos, count, to) :
+            copy_to_iter(data + q_pos, count, to);
+        done += n;
+        pos += n;
+        if (n < count) {
+            if (!done)
+                return nowait ? -EAGAIN : -EFAULT;
+            break;
+        }
+    }
+    return done;
+}
+
+/*
+ * The bare devices live in an xarray indexed by minor - scull_minor, so
+ * that any of them can come and go at run time without touching the
+ * others.  See scull_create() below.
+ */
+static DEFINE_XARRAY_ALLOC(scull_xa);
+
+static inline unsigned int scull_index(struct scull_dev *dev)
+{
+    return MINOR(dev->dev.devt) - scull_minor;
+}
+
+#ifdef SCULL_DEBUG /* use proc only if debugging */
+/*
+ * The proc filesystem: /proc/scullmem lists all the devices, one per
+ * seq_file record, and /proc/scull/N shows device N alone.  Neither takes
+ * dev->sem: they print snapshot counters, maintained by the writers, so
+ * looking at a busy device never stalls its I/O, however large it is.
+ * The walk of the xarray runs under RCU; devices are freed after a grace
+ * period.
+ */
+static struct proc_dir_entry *scull_proc_dir;
+
+static void scull_proc_show_dev(struct seq_file *s, struct scull_dev *dev)
+{
+    seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n", scull_index(dev),
+            READ_ONCE(dev->qset), READ_ONCE(dev->quantum), READ_ONCE(dev->size));
+    seq_printf(s, "  qsets %i, quanta %i\n",
+            READ_ONCE(dev->nr_qsets), READ_ONCE(dev->nr_quanta));
+}
+
+static void *scull_seq_start(struct seq_file *s, loff_t *pos)
+{
+    unsigned long index = *pos;
+    struct scull_dev *dev;
+
+    rcu_read_lock();
+    dev = xa_find(&scull_xa, &index, ULONG_MAX, XA_PRESENT);
+    if (dev)
+        *pos = index;
+    return dev;   /* NULL: no more to read */
+}
+
+static void *scull_seq_next(struct seq_file *s, void *v, loff_t *pos)
+{
+    unsigned long index = ++*pos;
+    struct scull_dev *dev;
+
+    dev = xa_find(&scull_xa, &index, ULONG_MAX, XA_PRESENT);
+    if (dev)
+        *pos = index;
+    return dev;
+}
+
+static void scull_seq_stop(struct seq_file *s, void *v)
+{
+    rcu_read_unlock();
+}
+
+static int scull_seq_show(struct seq_file *s, void *v)
+{
+    scull_proc_show_dev(s, v);
+    return 0;
+}
+
+static const struct seq_operations scull_seq_ops = {
+    .start = scull_seq_start,
+    .next  = scull_seq_next,
+    .stop  = scull_seq_stop,
+    .show  = scull_seq_show
+};
+
+static int scull_proc_dev_show(struct seq_file *s, void *v)
+{
+    scull_proc_show_dev(s, s->private);
+    return 0;
+}
+
+static void scull_create_proc(void)
+{
+    proc_create_seq("scullmem", 0 /* default mode */,
+            NULL /* parent dir */, &scull_seq_ops);
+    scull_proc_dir = proc_mkdir("scull", NULL);
+}
+
+static void scull_remove_proc(void)
+{
+    /* no problem if it was not registered */
+    remove_proc_entry("scullmem", NULL /* parent dir */);
+    remove_proc_subtree("scull", NULL);
+    scull_proc_dir = NULL;
+}
+
+static void scull_proc_add(struct scull_dev *dev)
+{
+    char name[16];
+
+    snprintf(name, sizeof(name), "%u", scull_index(dev));
+    proc_create_single_data(name, 0, scull_proc_dir, scull_proc_dev_show, dev);
+}
+
+static void scull_proc_del(struct scull_dev *dev)
+{
+    char name[16];
+
+    snprintf(name, sizeof(name), "%u", scull_index(dev));
+    remove_proc_entry(name, scull_proc_dir);  /* waits for readers */
+}
+#else
+static inline void scull_proc_add(struct scull_dev *dev) { }
+static inline void scull_proc_del(struct scull_dev *dev) { }
+#endif /* SCULL_DEBUG */
+
+/*
+ * sysfs attributes of the bare devices, in /sys/class/scull/scullN.  The
+ * geometry can only change while the device holds no data, which is when
+ * nothing depends on it.
+ */
+static ssize_t size_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct scull_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->size));
+}
+static DEVICE_ATTR_RO(size);
+
+/*
+ * A quantum is a single kmalloc, and so is a pointer array, while offsets
+ * into a list node are ints: keep the geometry within what both can take.
+ */
+static bool scull_geometry_valid(int quantum, int qset)
+{
+    return quantum > 0 && qset > 0 &&
+        (size_t)quantum <= KMALLOC_MAX_SIZE &&
+        (size_t)qset <= KMALLOC_MAX_SIZE / sizeof(void *) &&
+        (long long)quantum * qset <= INT_MAX;
+}
+
+static ssize_t scull_geometry_store(struct device *d, int *field,
+        const char *buf, size_t count)
+{
+    struct scull_dev *dev = dev_get_drvdata(d);
+    int val, retval;
+
+    retval = kstrtoint(buf, 0, &val);
+    if (retval)
+        return retval;
+    if (val <= 0)
+        return -EINVAL;
+
+    retval = scull_lock_idle(dev);
+    if (retval)
+        return retval;
+    if (dev->data)
+        retval = -EBUSY;              /* trim it first */
+    else if (field == &dev->quantum ? !scull_geometry_valid(val, dev->qset) :
+            !scull_geometry_valid(dev->quantum, val))
+        retval = -EINVAL;
+    else
+        WRITE_ONCE(*field, val);
+    scull_unlock(dev);
+    return retval ? retval : count;
+}
+
+static ssize_t quantum_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct scull_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%d\n", READ_ONCE(dev->quantum));
+}
+
+static ssize_t quantum_store(struct device *d, struct device_attribute *attr,
+        const char *buf, size_t count)
+{
+    struct scull_dev *dev = dev_get_drvdata(d);
+
+    return scull_geometry_store(d, &dev->quantum, buf, count);
+}
+static DEVICE_ATTR_RW(quantum);
+
+static ssize_t qset_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct scull_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%d\n", READ_ONCE(dev->qset));
+}
+
+static ssize_t qset_store(struct device *d, struct device_attribute *attr,
+        const char *buf, size_t count)
+{
+    struct scull_dev *dev = dev_get_drvdata(d);
+
+    return scull_geometry_store(d, &dev->qset, buf, count);
+}
+static DEVICE_ATTR_RW(qset);
+
+static ssize_t numa_node_show(struct device *d, struct device_attribute *attr,
+        char *buf)
+{
+    return sysfs_emit(buf, "%d\n", dev_to_node(d));
+}
+static DEVICE_ATTR_RO(numa_node);
+
+/* Indexed by SCULL_PLACE_*; a new policy only applies to new quanta */
+static const char * const scull_policy_names[] = {
+    [SCULL_PLACE_FIXED]      = "fixed",
+    [SCULL_PLACE_INTERLEAVE] = "interleave",
+    [SCULL_PLACE_LOCAL]      = "local",
+    [SCULL_PLACE_REPLICATE]  = "replicate",
+};
+
+static ssize_t policy_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct scull_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%s\n", scull_policy_names[READ_ONCE(dev->policy)]);
+}
+
+static ssize_t policy_store(struct device *d, struct device_attribute *attr,
+        const char *buf, size_t count)
+{
+    struct scull_dev *dev = dev_get_drvdata(d);
+    int policy = sysfs_match_string(scull_policy_names, buf);
+
+    if (policy < 0)
+        return policy;
+    WRITE_ONCE(dev->policy, policy);
+
+    /* nobody is writing: no need to wait for a close to freeze it */
+    if (policy == SCULL_PLACE_REPLICATE && !atomic_read(&dev->nwriters)) {
+        int retval = scull_freeze(dev);
+
+        if (retval && retval != -ENODATA)  /* empty: it waits for a close */
+            return retval;
+    }
+    return count;
+}
+static DEVICE_ATTR_RW(policy);
+
+static ssize_t frozen_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct scull_dev *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%d\n", !!rcu_access_pointer(dev->replica));
+}
+
+static ssize_t frozen_store(struct device *d, struct device_attribute *attr,
+        const char *buf, size_t count)
+{
+    struct scull_dev *dev = dev_get_drvdata(d);
+    bool freeze;
+    int retval;
+
+    retval = kstrtobool(buf, &freeze);
+    if (retval)
+        return retval;
+    retval = freeze ? scull_freeze(dev) : scull_thaw(dev);
+    return retval ? retval : count;
+}
+static DEVICE_ATTR_RW(frozen);
+
+static struct attribute *scull_attrs[] = {
+    &dev_attr_size.attr,
+    &dev_attr_quantum.attr,
+    &dev_attr_qset.attr,
+    &dev_attr_numa_node.attr,
+    &dev_attr_policy.attr,
+    &dev_attr_frozen.attr,
+    NULL
+};
+
+static const struct attribute_group scull_group = {
+    .attrs = scull_attrs,
+};
+
+static const struct attribute_group *scull_groups[] = {
+    &scull_group,
+    &scull_stats_group,               /* stats.c */
+    NULL
+};
+
+/* ---------------------- file operations ---------------------- */
+
+int scull_open(struct inode *inode, struct file *filp)
+{
+    struct scull_dev *dev;    /* device information */
+
+    dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+    filp->private_data = dev; /* for other methods */
+    filp->f_mode |= FMODE_NOWAIT; /* read_iter/write_iter honour IOCB_NOWAIT */
+
+    /* now trim to 0 the length of the device if open was write-only */
+    if ( (filp->f_flags & O_ACCMODE) == O_WRONLY && !(filp->f_flags & O_APPEND) ) {
+        if (scull_lock_idle(dev))
+            return -ERESTARTSYS;
+        scull_trim(dev);      /* ignore errors */
+        scull_unlock(dev);
+    }
+    if (filp->f_mode & FMODE_WRITE)
+        atomic_inc(&dev->nwriters);
+    return 0;                 /* success */
+}
+
+static ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct scull_dev *dev = iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(to);
+    bool nowait = scull_nowait(iocb), nonblock = scull_nonblock(iocb);
+    loff_t pos = iocb->ki_pos;
+    u64 t0 = local_clock();
+    struct scull_replica *rep;
+    size_t n;
+    ssize_t retval;
+    int idx;
+
+    /* a frozen device is read from this node's copy, without the lock */
+    idx = srcu_read_lock(&scull_srcu);
+    rep = srcu_dereference(dev->replica, &scull_srcu);
+    if (rep) {
+        retval = scull_read_replica(rep, pos, to, nowait);
+        srcu_read_unlock(&scull_srcu, idx);
+        if (retval > 0)
+            scull_stat_add(dev, SCULL_STAT_REPLICA_READS, 1);
+        goto done;
+    }
+    srcu_read_unlock(&scull_srcu, idx);
+
+retry:
+    /* fault in (at most a quantum of) the buffer before taking the lock */
+    n = min_t(size_t, count, READ_ONCE(dev->quantum));
+    if (n && !nowait && fault_in_iov_iter_writeable(to, n) == n) {
+        retval = -EFAULT;
+        goto out;
+    }
+
+    retval = scull_lock(dev, nonblock);  /* try to acquire semaphore */
+    if (retval)
+        goto out;
+    retval = scull_read_locked(dev, iocb->ki_pos, to);
+    scull_unlock(dev);
+
+    if (retval == -EFAULT) {           /* buffer got paged out again: retry */
+        if (nowait) {
+            retval = -EAGAIN;
+            goto out;
+        }
+        goto retry;
+    }
+
+done:
+    if (retval > 0) {
+        iocb->ki_pos += retval;
+        scull_stat_add(dev, SCULL_STAT_READS, 1);
+        scull_stat_add(dev, SCULL_STAT_READ_BYTES, retval);
+    }
+out:
+    scull_hist_add(dev, SCULL_HIST_READ, local_clock() - t0);
+    trace_scull_read(dev, pos, count, retval);
+    return retval;
+}
+
+/*
+ * Copy into a reserved slice that starts "q_pos" bytes into data[0] and
+ * may run on into data[1].  What could not be copied is zeroed, in case
+ * the slice has to be published regardless.  Return the number of bytes
+ * copied.
+ */
+static size_t scull_append_copy(void **data, int q_pos, int quantum,
+        size_t count, struct iov_iter *from)
+{
+    size_t first = min_t(size_t, count, quantum - q_pos), n;
+
+    n = copy_from_iter(data[0] + q_pos, first, from);
+    if (n == first && count > first)
+        n += copy_from_iter(data[1], count - first, from);
+
+    if (n < first)
+        memset(data[0] + q_pos + n, 0, first - n);
+    if (count > first)
+        memset(data[1] + max(n, first) - first, 0, count - max(n, first));
+    return n;
+}
+
+/*
+ * Publish the slices at the head of dev->appends whose copy is over, in
+ * reservation order, growing dev->size over them, and over what plain
+ * writes stored past them meanwhile.  dev->sem must be held.
+ */
+static void scull_append_publish(struct scull_dev *dev)
+{
+    struct scull_append *a, *next;
+    unsigned long pending;
+
+    list_for_each_entry_safe(a, next, &dev->appends, list) {
+        if (!a->done)
+            break;
+        if (dev->size < a->end)
+            dev->size = a->end;
+        WRITE_ONCE(dev->published_seq, a->seq);
+        WRITE_ONCE(dev->nappend, dev->nappend - 1);
+        list_del(&a->list);
+        kfree(a);
+    }
+
+    pending = dev->pending_size;
+    dev->pending_size = 0;
+    scull_grow_size(dev, pending);     /* kept back again if still blocked */
+}
+
+/*
+ * O_APPEND writes.  Under dev->sem an appender only installs the memory
+ * for its slice [pos, pos + count) and reserves it; the copy runs without
+ * the semaphore, concurrently with the other appenders, and may fault.
+ * dev->size then grows over the slices in reservation order, once each
+ * earlier one is copied too, so readers never see a slice being filled.
+ * Whichever appender finishes a copy publishes every slice ready by then,
+ * and the others only wait, killably, to see theirs published.
+ *
+ * A copy that faults gives back the part it could not copy, if nobody has
+ * reserved behind it yet; otherwise that part reads as zeros.  Slices not
+ * published yet are counted in dev->nappend, and keep trim away; plain
+ * writes meanwhile grow the size only up to the first of them, and new
+ * slices start past what those wrote.
+ */
+static ssize_t scull_append_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct scull_dev *dev = iocb->ki_filp->private_data;
+    bool nonblock = scull_nonblock(iocb);
+    struct scull_prealloc pa;
+    struct scull_append *a;
+    void *data[2] = { NULL, NULL };
+    int quantum, q_pos;
+    size_t count, n;
+    loff_t pos;
+    u64 seq;
+    ssize_t retval;
+
+    if (!iov_iter_count(from))
+        return 0;
+    /* the copy may fault: let io_uring retry from a worker */
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return -EAGAIN;
+
+    a = kmalloc(sizeof(*a), nonblock ? GFP_NOWAIT : GFP_KERNEL);
+    if (!a)
+        return nonblock ? -EAGAIN : -ENOMEM;
+    memset(&pa, 0, sizeof(pa));
+
+retry:
+    /* allocate what the tail is likely to need */
+    pos = READ_ONCE(dev->nappend) ? max(READ_ONCE(dev->reserved),
+            READ_ONCE(dev->pending_size)) : READ_ONCE(dev->size);
+    scull_prealloc_guess(dev, pos, min_t(size_t, iov_iter_count(from),
+                READ_ONCE(dev->quantum)), &pa);
+    if (scull_prealloc_fill(dev, &pa, READ_ONCE(dev->quantum), READ_ONCE(dev->qset),
+                nonblock ? GFP_NOWAIT : GFP_KERNEL)) {
+        retval = nonblock ? -EAGAIN : -ENOMEM;
+        goto fail;
+    }
+
+    retval = scull_lock(dev, nonblock);
+    if (retval)
+        goto fail;
+
+    scull_unfreeze(dev);
+
+    /* an append moves at most a quantum, like any other write */
+    quantum = dev->quantum;
+    count = min_t(size_t, iov_iter_count(from), quantum);
+    pos = dev->nappend ? max(dev->reserved, dev->pending_size) : dev->size;
+    q_pos = (long)pos % quantum;
+    if (!scull_pos_ok(dev, pos + count - 1)) {
+        scull_unlock(dev);
+        retval = -EFBIG;
+        goto fail;
+    }
+
+    data[0] = scull_install(dev, pos, &pa);
+    if (data[0] && q_pos + count > quantum)
+        data[1] = scull_install(dev, pos + quantum - q_pos, &pa);
+    if (!data[0] || (q_pos + count > quantum && !data[1])) {
+        scull_unlock(dev);             /* something was missing */
+        if (!scull_prealloc_needed(&pa)) {
+            retval = -ENOMEM;          /* and allocating would not help */
+            goto fail;
+        }
+        goto retry;
+    }
+
+    a->pos = pos;
+    a->end = pos + count;
+    a->seq = seq = ++dev->append_seq;
+    a->done = false;
+    list_add_tail(&a->list, &dev->appends);
+    WRITE_ONCE(dev->reserved, a->end);
+    WRITE_ONCE(dev->nappend, dev->nappend + 1);
+    scull_unlock(dev);
+    scull_prealloc_free(&pa);
+
+    n = scull_append_copy(data, q_pos, quantum, count, from);
+
+    /* the slice must be published whatever happens: no interruptions */
+    scull_lock_nofail(dev);
+    if (n < count && list_is_last(&a->list, &dev->appends)) {
+        a->end = pos + n;              /* nobody behind: give back the rest */
+        WRITE_ONCE(dev->reserved, a->end);
+    }
+    a->done = true;
+    scull_append_publish(dev);         /* "a" may be gone from here on */
+    scull_unlock(dev);
+    wake_up_all(&dev->append_wq);
+
+    /* readers see our slice once the earlier ones are copied too */
+    wait_event_killable(dev->append_wq, READ_ONCE(dev->published_seq) >= seq);
+
+    iocb->ki_pos = pos + n;
+    return n ? n : -EFAULT;
+
+fail:
+    scull_prealloc_free(&pa);
+    kfree(a);
+    return retval;
+}
+
+static ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct scull_dev *dev = iocb->ki_filp->private_data;
+    struct scull_prealloc pa;
+    size_t count = iov_iter_count(from);
+    bool nowait = scull_nowait(iocb), nonblock = scull_nonblock(iocb);
+    loff_t pos = iocb->ki_pos;
+    u64 t0 = local_clock();
+    int quantum;
+    size_t n;
+    ssize_t retval;
+
+    memset(&pa, 0, sizeof(pa));
+
+    if (iocb->ki_flags & IOCB_APPEND) {
+        retval = scull_append_iter(iocb, from);
+        if (retval > 0)
+            pos = iocb->ki_pos - retval;  /* where the slice went */
+        goto out;
+    }
+
+    if (!scull_pos_ok(dev, pos)) {
+        retval = -EFBIG;
+        goto out;
+    }
+
+retry:
+    /* fault in (at most a quantum of) the buffer before taking the lock */
+    n = min_t(size_t, count, READ_ONCE(dev->quantum));
+    if (n && !nowait && fault_in_iov_iter_readable(from, n) == n) {
+        retval = -EFAULT;
+        goto out;
+    }
+
+    /* and allocate whatever the write is likely to need, to the quantum's end */
+    quantum = READ_ONCE(dev->quantum);
+    scull_prealloc_guess(dev, iocb->ki_pos,
+            min_t(size_t, count, quantum - (long)iocb->ki_pos % quantum), &pa);
+    if (scull_prealloc_fill(dev, &pa, READ_ONCE(dev->quantum), READ_ONCE(dev->qset),
+                nonblock ? GFP_NOWAIT : GFP_KERNEL)) {
+        retval = nonblock ? -EAGAIN : -ENOMEM;
+        goto out;
+    }
+
+    retval = scull_lock(dev, nonblock);
+    if (retval)
+        goto out;
+    retval = scull_write_locked(dev, iocb->ki_pos, from, &pa);
+    scull_unlock(dev);
+
+    if (retval == -ENOMEM && scull_prealloc_needed(&pa))
+        goto retry;                    /* something was missing after all */
+    if (retval == -EFAULT) {           /* buffer got paged out again */
+        if (nowait) {
+            retval = -EAGAIN;
+            goto out;
+        }
+        goto retry;
+    }
+
+    if (retval > 0)
+        iocb->ki_pos += retval;
+out:
+    scull_prealloc_free(&pa);
+    if (retval > 0) {
+        scull_stat_add(dev, SCULL_STAT_WRITES, 1);
+        scull_stat_add(dev, SCULL_STAT_WRITE_BYTES, retval);
+    }
+    scull_hist_add(dev, SCULL_HIST_WRITE, local_clock() - t0);
+    trace_scull_write(dev, pos, count, retval);
+    return retval;
+}
+
+/* ---------------------- batched operations ---------------------- */
+
+/*
+ * Run a batch of extents under a single acquisition of dev->sem.  All the
+ * user buffers are faulted in up front; the semaphore is only dropped
+ * again if a write needs memory that was not preallocated, or a buffer
+ * got paged out in the meantime.  Each extent's outcome is stored in its
+ * ->result: the number of bytes moved, or a negative error code.
+ * "nowait" and "nonblock" are as for scull_nowait() and scull_nonblock().
+ */
+static int scull_run_extents(struct scull_dev *dev, unsigned int op,
+        struct scull_extent **ext, unsigned int nr, bool nowait, bool nonblock)
+{
+    struct scull_prealloc pa;
+    struct iov_iter iter;
+    unsigned int i = 0;
+    size_t done = 0;                   /* bytes of ext[i] moved so far */
+    ssize_t n = 0;
+    int retval;
+
+    memset(&pa, 0, sizeof(pa));
+
+    for (unsigned int j = 0; j < nr && !nowait; j++) {
+        void __user *ubuf = u64_to_user_ptr(ext[j]->addr);
+
+        if (op == SCULL_URING_CMD_READV)
+            fault_in_writeable(ubuf, ext[j]->len);
+        else if (op == SCULL_URING_CMD_WRITEV)
+            fault_in_readable(ubuf, ext[j]->len);
+    }
+
+retry:
+    /* allocate for the whole rest of the batch, not just the next quantum */
+    if (op != SCULL_URING_CMD_READV && i < nr) {
+        for (unsigned int j = i; j < nr; j++) {
+            size_t skip = j == i ? done : 0;
+
+            if (!ext[j]->result)
+                scull_prealloc_guess(dev, ext[j]->offset + skip, ext[j]->len - skip, &pa);
+        }
+        if (scull_prealloc_fill(dev, &pa, READ_ONCE(dev->quantum), READ_ONCE(dev->qset),
+                    nonblock ? GFP_NOWAIT : GFP_KERNEL)) {
+            retval = nonblock ? -EAGAIN : -ENOMEM;
+            goto out;
+        }
+    }
+
+    retval = scull_lock(dev, nonblock);
+    if (retval)
+        goto out;
+
+    for (; i < nr; i++, done = 0) {
+        struct scull_extent *e = ext[i];
+        void __user *ubuf = u64_to_user_ptr(e->addr);
+
+        if (e->result)                 /* rejected up front */
+            continue;
+
+        n = 0;
+        while (done < e->len) {
+            loff_t pos = e->offset + done;
+            size_t count = e->len - done;
+
+            switch (op) {
+            case SCULL_URING_CMD_READV:
+                iov_iter_ubuf(&iter, ITER_DEST, ubuf + done, count);
+                n = scull_read_locked(dev, pos, &iter);
+                break;
+            case SCULL_URING_CMD_WRITEV:
+                iov_iter_ubuf(&iter, ITER_SOURCE, ubuf + done, count);
+                n = scull_write_locked(dev, pos, &iter, &pa);
+                break;
+            default:
+                n = scull_alloc_locked(dev, pos, count, &pa);
+                break;
+            }
+            if (n <= 0)
+                break;
+            done += n;
+        }
+
+        if (n == -ENOMEM && scull_prealloc_needed(&pa)) {
+            scull_unlock(dev);         /* allocate outside the lock, then carry on */
+            goto retry;
+        }
+        if (n == -EFAULT) {
+            scull_unlock(dev);
+            if (nowait) {
+                retval = -EAGAIN;
+                goto out;
+            }
+            if ((op == SCULL_URING_CMD_READV ?
+                        fault_in_writeable(ubuf + done, e->len - done) :
+                        fault_in_readable(ubuf + done, e->len - done)) ==
+                    e->len - done) {
+                e->result = done ? done : -EFAULT; /* really unmapped: give up */
+                i++;
+                done = 0;
+            }
+            goto retry;
+        }
+        e->result = done ? done : n;   /* n: 0 at the end, or an error */
+        if (op == SCULL_URING_CMD_READV) {
+            scull_stat_add(dev, SCULL_STAT_READS, 1);
+            scull_stat_add(dev, SCULL_STAT_READ_BYTES, done);
+        } else if (op == SCULL_URING_CMD_WRITEV) {
+            scull_stat_add(dev, SCULL_STAT_WRITES, 1);
+            scull_stat_add(dev, SCULL_STAT_WRITE_BYTES, done);
+        }
+    }
+    scull_unlock(dev);
+
+out:
+    scull_prealloc_free(&pa);
+    return retval;
+}
+
+static int scull_extent_cmp(const void *a, const void *b)
+{
+    const struct scull_extent *x = *(const struct scull_extent **)a;
+    const struct scull_extent *y = *(const struct scull_extent **)b;
+
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return x < y ? -1 : x > y;         /* same offset: keep submission order */
+}
+
+/*
+ * Copy an extent list in from user space, run it in offset order, and copy
+ * the per-extent results back out in the caller's order.  "mode" is the
+ * file's: a batch needs the same access as read() or write() would.
+ *
+ * With "nowait", the list itself is copied in and out with page faults
+ * disabled and its memory allocated with GFP_NOWAIT, and -EAGAIN means
+ * "run it again from a worker".  That may happen after the batch ran, if
+ * the results could not be stored; running positional operations twice
+ * leaves the device as running them once would.
+ */
+static int scull_extents(struct scull_dev *dev, fmode_t mode, unsigned int op,
+        struct scull_extent __user *uext, unsigned int nr, bool nowait, bool nonblock)
+{
+    gfp_t gfp = nowait ? GFP_NOWAIT : GFP_KERNEL;
+    size_t size = nr * sizeof(struct scull_extent);
+    struct scull_extent *ext, **order;
+    int retval;
+
+    if (!(mode & (op == SCULL_URING_CMD_READV ? FMODE_READ : FMODE_WRITE)))
+        return -EBADF;
+    if (!nr || nr > SCULL_MAX_EXTENTS)
+        return -EINVAL;
+
+    ext = kmalloc(size, gfp);
+    order = kmalloc_array(nr, sizeof(*order), gfp);
+    if (!ext || !order) {
+        retval = nowait ? -EAGAIN : -ENOMEM;
+        goto out;
+    }
+    if (nowait ? copy_from_user_nofault(ext, uext, size) : copy_from_user(ext, uext, size)) {
+        retval = nowait ? -EAGAIN : -EFAULT;
+        goto out;
+    }
+
+    for (unsigned int i = 0; i < nr; i++) {
+        ext[i].result = 0;
+        if (ext[i].len > INT_MAX ||    /* ->result could not tell it from an error */
+                ext[i].offset > MAX_LFS_FILESIZE - ext[i].len)
+            ext[i].result = -EINVAL;
+        else if (op != SCULL_URING_CMD_READV && ext[i].len &&
+                !scull_pos_ok(dev, ext[i].offset + ext[i].len - 1))
+            ext[i].result = -EFBIG;
+        else if (op != SCULL_URING_CMD_PREALLOC &&
+                !access_ok(u64_to_user_ptr(ext[i].addr), ext[i].len))
+            ext[i].result = -EFAULT;
+        order[i] = &ext[i];
+    }
+    sort(order, nr, sizeof(*order), scull_extent_cmp, NULL);
+
+    retval = scull_run_extents(dev, op, order, nr, nowait, nonblock);
+    if (!retval && (nowait ? copy_to_user_nofault(uext, ext, size) :
+                copy_to_user(uext, ext, size)))
+        retval = nowait ? -EAGAIN : -EFAULT;
+
+out:
+    kfree(order);
+    kfree(ext);
+    return retval;
+}
+
+#ifdef CONFIG_IO_URING
+/*
+ * io_uring passthrough: the SQE carries a struct scull_batch naming an
+ * extent list, so a single submission moves many extents under one lock
+ * acquisition and completes once.  On the inline (IO_URING_F_NONBLOCK)
+ * attempt nothing may sleep; -EAGAIN makes io_uring retry from a worker.
+ */
+static int scull_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct scull_dev *dev = ioucmd->file->private_data;
+    const struct scull_batch *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+    bool nowait;
+
+    switch (ioucmd->cmd_op) {
+    case SCULL_URING_CMD_READV:
+    case SCULL_URING_CMD_WRITEV:
+    case SCULL_URING_CMD_PREALLOC:
+        break;
+    default:
+        return -ENOTTY;
+    }
+    if (READ_ONCE(cmd->flags))
+        return -EINVAL;
+
+    nowait = issue_flags & IO_URING_F_NONBLOCK;
+    return scull_extents(dev, ioucmd->file->f_mode, ioucmd->cmd_op,
+            u64_to_user_ptr(READ_ONCE(cmd->extents)), READ_ONCE(cmd->nr_extents),
+            nowait, nowait || (ioucmd->file->f_flags & O_NONBLOCK));
+}
+#endif
+
+/*
+ * The ioctl() implementation: the batched extent operations, for callers
+ * without io_uring, one syscall and one lock round trip per batch; and
+ * freezing the device.
+ */
+static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_dev *dev = filp->private_data;
+    struct scull_batch batch;
+    unsigned int op;
+
+    /*
+     * extract the type and number bitfields, and don't decode
+     * wrong cmds: return ENOTTY (inappropriate ioctl) before access_ok()
+     */
+    if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
+    if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
+
+    switch (cmd) {
+    case SCULL_IOCSFROZEN: /* Set: arg is the value */
+        if (!(filp->f_mode & FMODE_WRITE))
+            return -EBADF;            /* the same right as to write */
+        return arg ? scull_freeze(dev) : scull_thaw(dev);
+
+    case SCULL_IOCQFROZEN: /* Query: return it (it's positive) */
+        return !!rcu_access_pointer(dev->replica);
+
+    case SCULL_IOCREADV:
+        op = SCULL_URING_CMD_READV;
+        break;
+    case SCULL_IOCWRITEV:
+        op = SCULL_URING_CMD_WRITEV;
+        break;
+    case SCULL_IOCPREALLOC:
+        op = SCULL_URING_CMD_PREALLOC;
+        break;
+    default:  /* not one of ours (pipe ioctls share the numbering) */
+        return -ENOTTY;
+    }
+
+    if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+        return -EFAULT;
+    if (batch.flags)
+        return -EINVAL;
+
+    return scull_extents(dev, filp->f_mode, op, u64_to_user_ptr(batch.extents),
+            batch.nr_extents, false, filp->f_flags & O_NONBLOCK);
+}
+
+/* The last writer of a REPLICATE device is gone: copy it for the readers */
+int scull_release(struct inode *inode, struct file *filp)
+{
+    struct scull_dev *dev = filp->private_data;
+
+    /* the copies take a while, and a fatal signal must not skip them */
+    if ((filp->f_mode & FMODE_WRITE) && atomic_dec_and_test(&dev->nwriters) &&
+            READ_ONCE(dev->policy) == SCULL_PLACE_REPLICATE) {
+        get_device(&dev->dev);
+        if (!queue_work(scull_wq, &dev->freeze_work))
+            put_device(&dev->dev);     /* already queued */
+    }
+    return 0;
+}
+
+/* ---------------------- module stuff ---------------------- */
+
+struct file_operations scull_fops = {
+    .owner = THIS_MODULE,
+    .open = scull_open,
+    .read_iter = scull_read_iter,
+    .write_iter = scull_write_iter,
+    .unlocked_ioctl = scull_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+#ifdef CONFIG_IO_URING
+    .uring_cmd = scull_uring_cmd,
+#endif
+    .release = scull_release,
+};
+
+/* ---------------------- device lifetime ---------------------- */
+
+/*
+ * Each bare device embeds its struct device, and is freed by the release
+ * callback once the last reference is gone.  Open files hold one through
+ * the cdev, so a device can be destroyed while in use: it disappears from
+ * /dev and the xarray at once, and its data when the last file closes.
+ */
+static void scull_free_dev(struct rcu_head *rcu)
+{
+    kmem_cache_free(scull_dev_cache, container_of(rcu, struct scull_dev, rcu));
+}
+
+static void scull_release_dev(struct device *d)
+{
+    struct scull_dev *dev = container_of(d, struct scull_dev, dev);
+
+    scull_trim(dev);                /* and drops the replicas */
+    kfree(dev->node_quanta);
+    free_percpu(dev->stats);
+    call_rcu(&dev->rcu, scull_free_dev); /* /proc/scullmem may be looking at it */
+}
+
+/*
+ * Create the bare device "index", or any free one if it is negative,
+ * with the given geometry, on NUMA node "node" (NUMA_NO_NODE: wherever
+ * the allocator likes) and with the quantum placement "policy".  The slot is
+ * reserved first and only filled in once the device is complete.  Called
+ * with scull_ctl_lock held, or from init.  Returns the index, or a
+ * negative error code.
+ */
+static int scull_create(int index, int quantum, int qset, int node, int policy)
+{
+    struct scull_dev *dev;
+    u32 id = index;
+    int err;
+
+    if (index >= SCULL_MAX_DEVS || !scull_geometry_valid(quantum, qset))
+        return -EINVAL;
+    if (node != NUMA_NO_NODE &&
+            (node < 0 || node >= nr_node_ids || !node_state(node, N_MEMORY)))
+        return -EINVAL;
+    if (policy < 0 || policy >= ARRAY_SIZE(scull_policy_names))
+        return -EINVAL;
+
+    if (index < 0)
+        err = xa_alloc(&scull_xa, &id, NULL, XA_LIMIT(0, SCULL_MAX_DEVS - 1),
+                GFP_KERNEL);
+    else
+        err = xa_insert(&scull_xa, id, NULL, GFP_KERNEL);
+    if (err)
+        return err;                    /* -EBUSY: taken, or no room left */
+
+    dev = kmem_cache_alloc_node(scull_dev_cache, GFP_KERNEL | __GFP_ZERO, node);
+    if (!dev) {
+        xa_release(&scull_xa, id);
+        return -ENOMEM;
+    }
+    dev->stats = alloc_percpu(struct scull_stats);
+    dev->node_quanta = kcalloc_node(nr_node_ids, sizeof(int), GFP_KERNEL, node);
+    if (!dev->stats || !dev->node_quanta) {
+        kfree(dev->node_quanta);
+        free_percpu(dev->stats);
+        kmem_cache_free(scull_dev_cache, dev);
+        xa_release(&scull_xa, id);
+        return -ENOMEM;
+    }
+    dev->quantum = quantum;
+    dev->qset = qset;
+    dev->policy = policy;
+    dev->next_node = NUMA_NO_NODE;
+    sema_init(&dev->sem, 1);
+    INIT_LIST_HEAD(&dev->appends);
+    init_waitqueue_head(&dev->append_wq);
+    INIT_WORK(&dev->freeze_work, scull_freeze_work);
+
+    device_initialize(&dev->dev);   /* from here on, put_device() frees it */
+    dev->dev.class = scull_class;
+    dev->dev.devt = MKDEV(scull_major, scull_minor + id);
+    dev->dev.groups = scull_groups;
+    dev->dev.release = scull_release_dev;
+    set_dev_node(&dev->dev, node);
+    dev_set_drvdata(&dev->dev, dev);
+    cdev_init(&dev->cdev, &scull_fops);
+    dev->cdev.owner = THIS_MODULE;
+
+    err = dev_set_name(&dev->dev, "scull%u", id);
+    if (!err)
+        err = cdev_device_add(&dev->cdev, &dev->dev);
+    if (err) {
+        printk(KERN_NOTICE "Error %d adding scull%u", err, id);
+        xa_release(&scull_xa, id);
+        put_device(&dev->dev);
+        return err;
+    }
+
+    xa_store(&scull_xa, id, dev, GFP_KERNEL); /* the slot exists: cannot fail */
+    scull_proc_add(dev);
+    scull_debugfs_add(dev);
+    return id;
+}
+
+/* Destroy bare device "index"; same locking as scull_create() */
+static int scull_destroy(unsigned long index)
+{
+    struct scull_dev *dev = xa_erase(&scull_xa, index);
+
+    if (!dev)
+        return -ENOENT;
+    scull_debugfs_del(dev);
+    scull_proc_del(dev);
+    cdev_device_del(&dev->cdev, &dev->dev);
+    put_device(&dev->dev);
+    return 0;
+}
+
+/*
+ * The control device, /dev/scullctl, creates and destroys bare devices.
+ * Its lock only serializes those two operations with each other.
+ */
+static DEFINE_MUTEX(scull_ctl_lock);
+
+static long scull_ctl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_ctl ctl;
+    long retval;
+
+    if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
+    if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    switch (cmd) {
+    case SCULL_CTL_IOCCREATE:
+        if (copy_from_user(&ctl, (void __user *)arg, sizeof(ctl)))
+            return -EFAULT;
+        if (ctl.flags || ctl.quantum < 0 || ctl.qset < 0)
+            return -EINVAL;
+        mutex_lock(&scull_ctl_lock);
+        retval = scull_create(ctl.index, ctl.quantum ? : scull_quantum,
+                ctl.qset ? : scull_qset, ctl.node, ctl.policy);
+        mutex_unlock(&scull_ctl_lock);
+        if (retval < 0)
+            return retval;
+        ctl.index = retval;
+        if (copy_to_user((void __user *)arg, &ctl, sizeof(ctl)))
+            return -EFAULT;           /* the device stays */
+        return 0;
+
+    case SCULL_CTL_IOCDESTROY: /* arg is the index */
+        mutex_lock(&scull_ctl_lock);
+        retval = scull_destroy(arg);
+        mutex_unlock(&scull_ctl_lock);
+        return retval;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct file_operations scull_ctl_fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = scull_ctl_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+static struct miscdevice scull_ctl_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "scullctl",
+    .fops = &scull_ctl_fops,
+    .mode = 0600,
+};
+static bool scull_ctl_registered;
+
+/*
+ * The cleanup function is used to handle initialization failures as well.
+ * Thefore, it must be careful to work correctly even if some of the items
+ * have not been initialized
+ */
+void scull_cleanup_module(void)
+{
+    dev_t devno = MKDEV(scull_major, scull_minor);
+    struct scull_dev *dev;
+    unsigned long index;
+
+    /* no more creations first */
+    if (scull_ctl_registered)
+        misc_deregister(&scull_ctl_dev);
+
+    /* Get rid of our char dev entries */
+    xa_for_each(&scull_xa, index, dev)
+        scull_destroy(index);
+    xa_destroy(&scull_xa);
+    if (scull_wq)
+        destroy_workqueue(scull_wq);  /* the freezes still hold devices */
+    srcu_barrier(&scull_srcu);        /* replicas dropped by the last trims */
+    rcu_barrier();                    /* for the last scull_free_dev() */
+    kmem_cache_destroy(scull_dev_cache);  /* fine if NULL */
+
+#ifdef SCULL_DEBUG /* use proc only if debugging */
+    scull_remove_proc();
+#endif
+    scull_debugfs_remove();
+
+    /* cleanup_module is never called if registering failed */
+    unregister_chrdev_region(devno, SCULL_MAX_DEVS);
+
+    /* and call the cleanup functions for friend devices */
+    scull_p_cleanup();
+    scull_l_cleanup();
+    scull_mq_cleanup();
+    scull_pc_cleanup();
+
+    if (scull_class)
+        class_destroy(scull_class);   /* after all our devices are gone */
+}
+
+
+int scull_init_module(void)
+{
+    int result;
+    dev_t dev = 0;
+
+    if (scull_nr_devs < 0 || scull_nr_devs > SCULL_MAX_DEVS) {
+        printk(KERN_WARNING "scull: scull_nr_devs must be 0 to %d\n", SCULL_MAX_DEVS);
+        return -EINVAL;
+    }
+
+    /*
+     * Get a range of minor numbers to work with, asking for a dynamic
+     * major unless directed otherwise at load time.  It covers all the
+     * bare devices there can ever be, not just the ones created now.
+     */
+    if (scull_major) {
+        dev = MKDEV(scull_major, scull_minor);
+        result = register_chrdev_region(dev, SCULL_MAX_DEVS, "scull");
+    } else {
+        result = alloc_chrdev_region(&dev, scull_minor, SCULL_MAX_DEVS,
+                "scull");
+        scull_major = MAJOR(dev);
+    }
+    if (result < 0) {
+        printk(KERN_WARNING "scull: can't get major %d\n", scull_major);
+        return result;
+    }
+
+    /* udev creates the /dev nodes as each device is registered with it */
+    scull_class = class_create("scull");
+    if (IS_ERR(scull_class)) {
+        result = PTR_ERR(scull_class);
+        scull_class = NULL;
+        goto fail;
+    }
+
+    scull_dev_cache = kmem_cache_create("scull_dev", sizeof(struct scull_dev), 0,
+            SLAB_HWCACHE_ALIGN, NULL);
+    if (!scull_dev_cache) {
+        result = -ENOMEM;
+        goto fail;
+    }
+
+    scull_wq = alloc_workqueue("scull", WQ_UNBOUND, 0);
+    if (!scull_wq) {
+        result = -ENOMEM;
+        goto fail;
+    }
+
+#ifdef SCULL_DEBUG /* only when debugging */
+    scull_create_proc();
+#endif
+    scull_debugfs_create();
+
+    /* Create the initial devices. */
+    for (int i = 0; i < scull_nr_devs; i++) {
+        result = scull_create(i, scull_quantum, scull_qset, scull_node,
+                SCULL_PLACE_FIXED);
+        if (result < 0)
+            goto fail;
+    }
+
+    /* At this point call the init function for any friend device */
+    dev = MKDEV(scull_major, scull_minor + SCULL_MAX_DEVS);
+    dev += scull_p_init(dev);
+    dev += SCULL_ACCESS_NR_DEVS;   /* reserved, see scull.h */
+    dev += scull_l_init(dev);
+    dev += scull_mq_init(dev);
+    dev += scull_pc_init(dev);
+
+    result = misc_register(&scull_ctl_dev);
+    if (result)
+        goto fail;
+    scull_ctl_registered = true;
+
+    return 0; /* succeed */
+
+fail:
+    scull_cleanup_module();
+    return result;
+}
+
+module_init(scull_init_module);
+module_exit(scull_cleanup_module);
@@ -0,0 +1,506 @@
+/*
+ * mq.c -- message queue driver for scull
+ *
+ * Like SOCK_SEQPACKET: each write() queues one record, each read()
+ * returns exactly one, and message boundaries survive the trip.  Records
+ * sit back to back in a ring, each behind a 4-byte length header, and
+ * SCULL_MQ_IOCREADV drains many of them into one buffer at once.
+ *
+ * There is one ring per priority level.  Writers pick their level per
+ * file (SCULL_MQ_IOCSPRIO), readers always get the oldest record of the
+ * highest non-empty level, so control traffic overtakes queued bulk data.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk(), min() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/vmalloc.h>	/* vmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/fcntl.h>
+#include <linux/poll.h>
+#include <linux/cdev.h>
+#include <linux/device.h>	/* device_create() */
+#include <linux/sched/signal.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>		/* roundup_pow_of_two() */
+#include <linux/bitops.h>	/* __fls() */
+
+#include <linux/uaccess.h>	/* copy_*_user */
+
+#include "scull.h"
+
+/*
+ * A ring of records.  "in" and "out" are free-running byte positions,
+ * masked with size - 1; records start 4-byte aligned, so a header never
+ * straddles the end of the ring, though the payload may.
+ */
+struct scull_mq_ring {
+    char *buffer;
+    unsigned int size;              /* a power of two */
+    unsigned int in, out;           /* where to write, where to read */
+    unsigned int nrecords;          /* records queued */
+};
+
+struct scull_mq {
+    wait_queue_head_t inq, outq;    /* read and write queues */
+    struct scull_mq_ring ring[SCULL_MQ_NR_PRIOS]; /* one per level */
+    unsigned int nrecords;          /* records queued, all levels */
+    unsigned long ready;            /* bit n set: ring[n] is not empty */
+    int nopen;                      /* number of openings */
+    struct mutex lock;              /* protects the rings */
+    struct semaphore sem;           /* protects open/release bookkeeping */
+    struct cdev cdev;               /* Char device structure */
+};
+
+struct scull_mq_file {
+    struct scull_mq *dev;
+    int prio;                       /* level this file writes at */
+};
+
+#define SCULL_MQ_HDR  sizeof(__u32)         /* the length header */
+#define SCULL_MQ_SPACE(len)  ALIGN(SCULL_MQ_HDR + (len), SCULL_MQ_HDR)
+
+/* parameters */
+static int scull_mq_nr_devs = SCULL_MQ_NR_DEVS;  /* number of queues */
+int scull_mq_buffer = SCULL_MQ_BUFFER;           /* ring size */
+static dev_t scull_mq_devno;                     /* Our first device number */
+
+module_param(scull_mq_nr_devs, int, S_IRUGO);
+module_param(scull_mq_buffer, int, S_IRUGO);
+
+static struct scull_mq *scull_mq_devices;
+
+/* ---------------------- ring helpers ---------------------- */
+
+static unsigned int scull_mq_free(struct scull_mq_ring *r)
+{
+    return r->size - (r->in - r->out);
+}
+
+/* The largest record a ring can hold */
+static unsigned int scull_mq_max(struct scull_mq_ring *r)
+{
+    return r->size - SCULL_MQ_HDR;
+}
+
+/*
+ * Copy between user space and the ring at byte position "pos", in two
+ * pieces if the range wraps.  Return nonzero on fault, like copy_*_user.
+ */
+static int scull_mq_copy_in(struct scull_mq_ring *r, unsigned int pos,
+        const char __user *buf, size_t len)
+{
+    unsigned int off = pos & (r->size - 1);
+    size_t l = min_t(size_t, len, r->size - off);
+
+    return copy_from_user(r->buffer + off, buf, l) ||
+        copy_from_user(r->buffer, buf + l, len - l);
+}
+
+static int scull_mq_copy_out(struct scull_mq_ring *r, unsigned int pos,
+        char __user *buf, size_t len)
+{
+    unsigned int off = pos & (r->size - 1);
+    size_t l = min_t(size_t, len, r->size - off);
+
+    return copy_to_user(buf, r->buffer + off, l) ||
+        copy_to_user(buf + l, r->buffer, len - l);
+}
+
+static __u32 scull_mq_peek(struct scull_mq_ring *r)
+{
+    return *(__u32 *)(r->buffer + (r->out & (r->size - 1)));
+}
+
+/* The ring of the highest level with records queued; there must be one */
+static struct scull_mq_ring *scull_mq_head(struct scull_mq *dev)
+{
+    return &dev->ring[__fls(dev->ready)];
+}
+
+/* Queue one record at level "prio"; the caller has checked that it fits */
+static int scull_mq_push(struct scull_mq *dev, int prio,
+        const char __user *buf, size_t len)
+{
+    struct scull_mq_ring *r = &dev->ring[prio];
+
+    if (scull_mq_copy_in(r, r->in + SCULL_MQ_HDR, buf, len))
+        return -EFAULT;
+    *(__u32 *)(r->buffer + (r->in & (r->size - 1))) = len;
+    r->in += SCULL_MQ_SPACE(len);
+    r->nrecords++;
+    __set_bit(prio, &dev->ready);
+    WRITE_ONCE(dev->nrecords, dev->nrecords + 1);
+    return 0;
+}
+
+/* Drop the record at the head of ring "r" */
+static void scull_mq_pop(struct scull_mq *dev, struct scull_mq_ring *r)
+{
+    r->out += SCULL_MQ_SPACE(scull_mq_peek(r));
+    if (--r->nrecords == 0)
+        __clear_bit(r - dev->ring, &dev->ready);
+    WRITE_ONCE(dev->nrecords, dev->nrecords - 1);
+}
+
+/* ---------------------- file operations ---------------------- */
+
+static void scull_mq_free_rings(struct scull_mq *dev)
+{
+    for (int i = 0; i < SCULL_MQ_NR_PRIOS; i++) {
+        vfree(dev->ring[i].buffer);
+        dev->ring[i].buffer = NULL; /* the other fields are reset on open */
+    }
+}
+
+static int scull_mq_open(struct inode *inode, struct file *filp)
+{
+    struct scull_mq *dev;
+    struct scull_mq_file *mf;
+
+    dev = container_of(inode->i_cdev, struct scull_mq, cdev);
+
+    mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+    if (!mf)
+        return -ENOMEM;
+    mf->dev = dev;                  /* and prio 0, the lowest */
+    filp->private_data = mf;
+
+    if (down_interruptible(&dev->sem)) {
+        kfree(mf);
+        return -ERESTARTSYS;
+    }
+    if (!dev->nopen) {
+        /* allocate the rings */
+        for (int i = 0; i < SCULL_MQ_NR_PRIOS; i++) {
+            struct scull_mq_ring *r = &dev->ring[i];
+
+            r->buffer = vmalloc(scull_mq_buffer);
+            if (!r->buffer) {
+                scull_mq_free_rings(dev);
+                up(&dev->sem);
+                kfree(mf);
+                return -ENOMEM;
+            }
+            r->size = scull_mq_buffer;
+            r->in = r->out = r->nrecords = 0;
+        }
+        dev->nrecords = 0;
+        dev->ready = 0;
+    }
+    dev->nopen++;
+    up(&dev->sem);
+
+    return nonseekable_open(inode, filp);
+}
+
+static int scull_mq_release(struct inode *inode, struct file *filp)
+{
+    struct scull_mq_file *mf = filp->private_data;
+    struct scull_mq *dev = mf->dev;
+
+    down(&dev->sem);
+    if (--dev->nopen == 0)
+        scull_mq_free_rings(dev);
+    up(&dev->sem);
+    kfree(mf);
+    return 0;
+}
+
+/*
+ * Take dev->lock once there is at least one record to read.  On error
+ * the lock is not held.
+ */
+static int scull_mq_wait_record(struct scull_mq *dev, struct file *filp)
+{
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+    while (!dev->nrecords) { /* nothing to read */
+        mutex_unlock(&dev->lock);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->inq, READ_ONCE(dev->nrecords)))
+            return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+        if (mutex_lock_interruptible(&dev->lock))
+            return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+/*
+ * Read one record, from the highest level that has any.  As with
+ * SOCK_SEQPACKET, a record longer than the buffer is truncated and the
+ * rest of it discarded.
+ */
+static ssize_t scull_mq_read(struct file *filp, char __user *buf, size_t count,
+        loff_t *f_pos)
+{
+    struct scull_mq_file *mf = filp->private_data;
+    struct scull_mq *dev = mf->dev;
+    struct scull_mq_ring *r;
+    ssize_t retval;
+
+    retval = scull_mq_wait_record(dev, filp);
+    if (retval)
+        return retval;
+
+    r = scull_mq_head(dev);
+    count = min_t(size_t, count, scull_mq_peek(r));
+    if (scull_mq_copy_out(r, r->out + SCULL_MQ_HDR, buf, count)) {
+        mutex_unlock(&dev->lock);
+        return -EFAULT;                /* the record stays queued */
+    }
+    scull_mq_pop(dev, r);
+    mutex_unlock(&dev->lock);
+
+    /* finally, awake any writers and return */
+    wake_up_interruptible(&dev->outq);
+    return count;
+}
+
+/* Write one record, at this file's level: all of it, or nothing */
+static ssize_t scull_mq_write(struct file *filp, const char __user *buf,
+        size_t count, loff_t *f_pos)
+{
+    struct scull_mq_file *mf = filp->private_data;
+    struct scull_mq *dev = mf->dev;
+    int prio = READ_ONCE(mf->prio);
+    struct scull_mq_ring *r = &dev->ring[prio];
+    ssize_t retval;
+
+    if (count > scull_mq_max(r))
+        return -EMSGSIZE;
+
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+    while (scull_mq_free(r) < SCULL_MQ_SPACE(count)) { /* full */
+        mutex_unlock(&dev->lock);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->outq,
+                    scull_mq_free(r) >= SCULL_MQ_SPACE(count)))
+            return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+        if (mutex_lock_interruptible(&dev->lock))
+            return -ERESTARTSYS;
+    }
+
+    retval = scull_mq_push(dev, prio, buf, count);
+    mutex_unlock(&dev->lock);
+    if (retval)
+        return retval;
+
+    /* finally, awake any reader */
+    wake_up_interruptible(&dev->inq);
+    return count;
+}
+
+/*
+ * Records above the lowest level show up as EPOLLPRI | EPOLLRDBAND, so
+ * that a reader can wait for urgent traffic only; SCULL_MQ_IOCQREADY
+ * tells the levels apart.  Writability is that of this file's level.
+ */
+static __poll_t scull_mq_poll(struct file *filp, poll_table *wait)
+{
+    struct scull_mq_file *mf = filp->private_data;
+    struct scull_mq *dev = mf->dev;
+    struct scull_mq_ring *r = &dev->ring[READ_ONCE(mf->prio)];
+    __poll_t mask = 0;
+
+    poll_wait(filp, &dev->inq,  wait);
+    poll_wait(filp, &dev->outq, wait);
+    mutex_lock(&dev->lock);
+    if (dev->nrecords)
+        mask |= EPOLLIN | EPOLLRDNORM;   /* readable */
+    if (dev->ready & ~1UL)
+        mask |= EPOLLPRI | EPOLLRDBAND;  /* urgent records */
+    if (scull_mq_free(r) >= SCULL_MQ_SPACE(0))
+        mask |= EPOLLOUT | EPOLLWRNORM;  /* writable, for small records */
+    mutex_unlock(&dev->lock);
+    return mask;
+}
+
+/*
+ * Drain as many whole records as fit into one user buffer, back to back,
+ * and say where each one landed in an offset table: one syscall, one lock
+ * round trip and one copy per record for a whole batch.  Records come out
+ * in the order read() would return them.
+ */
+static long scull_mq_readv(struct scull_mq *dev, struct file *filp,
+        struct scull_mq_batch __user *ubatch)
+{
+    struct scull_mq_batch batch;
+    struct scull_mq_rec *table;
+    char __user *buf;
+    __u32 n = 0, used = 0;
+    long retval;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (!batch.max || batch.max > SCULL_MQ_MAX_BATCH || batch.flags)
+        return -EINVAL;
+    buf = u64_to_user_ptr(batch.buf);
+
+    table = kmalloc_array(batch.max, sizeof(*table), GFP_KERNEL);
+    if (!table)
+        return -ENOMEM;
+
+    retval = scull_mq_wait_record(dev, filp);
+    if (retval)
+        goto out;
+
+    while (n < batch.max && dev->nrecords) {
+        struct scull_mq_ring *r = scull_mq_head(dev);
+        __u32 len = scull_mq_peek(r);
+
+        if (len > batch.buflen - used)
+            break;
+        if (scull_mq_copy_out(r, r->out + SCULL_MQ_HDR, buf + used, len)) {
+            retval = -EFAULT;
+            break;
+        }
+        table[n].offset = used;
+        table[n].len = len;
+        scull_mq_pop(dev, r);
+        used += len;
+        n++;
+    }
+    mutex_unlock(&dev->lock);
+
+    if (n)
+        wake_up_interruptible(&dev->outq);
+    if (!n && !retval)
+        retval = -EMSGSIZE;            /* the first record does not fit */
+    if (n) {
+        /* the records are gone from the queue: report them regardless */
+        retval = n;
+        if (copy_to_user(u64_to_user_ptr(batch.table), table, n * sizeof(*table)) ||
+                put_user(n, &ubatch->count))
+            retval = -EFAULT;
+    }
+
+out:
+    kfree(table);
+    return retval;
+}
+
+/*
+ * The ioctl() implementation
+ */
+static long scull_mq_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_mq_file *mf = filp->private_data;
+    struct scull_mq *dev = mf->dev;
+
+    if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
+    if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
+
+    switch (cmd) {
+    case SCULL_MQ_IOCREADV:
+        return scull_mq_readv(dev, filp, (struct scull_mq_batch __user *)arg);
+
+    case SCULL_MQ_IOCSPRIO: /* Set: arg is the value */
+        if (arg >= SCULL_MQ_NR_PRIOS)
+            return -EINVAL;
+        WRITE_ONCE(mf->prio, arg);
+        return 0;
+
+    case SCULL_MQ_IOCQPRIO: /* Query: return it (it's positive) */
+        return READ_ONCE(mf->prio);
+
+    case SCULL_MQ_IOCQREADY: /* Query: the levels with records queued */
+        return READ_ONCE(dev->ready);
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * The file operations for the message queue device
+ */
+struct file_operations scull_mq_fops = {
+    .owner = THIS_MODULE,
+    .read = scull_mq_read,
+    .write = scull_mq_write,
+    .poll = scull_mq_poll,
+    .unlocked_ioctl = scull_mq_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .open = scull_mq_open,
+    .release = scull_mq_release,
+};
+
+/*
+ * Set up a cdev entry.
+ */
+static void scull_mq_setup_cdev(struct scull_mq *dev, int index)
+{
+    int err, devno = scull_mq_devno + index;
+
+    cdev_init(&dev->cdev, &scull_mq_fops);
+    dev->cdev.owner = THIS_MODULE;
+    err = cdev_add(&dev->cdev, devno, 1);
+    /* Fail gracefully if need be */
+    if (err)
+        printk(KERN_NOTICE "Error %d adding scullmq%d", err, index);
+    else
+        device_create(scull_class, NULL, devno, NULL, "scullmq%d", index);
+}
+
+/*
+ * Initialize the queues; return how many we did.
+ */
+int scull_mq_init(dev_t firstdev)
+{
+    int result;
+
+    if (scull_mq_buffer < 2 * SCULL_MQ_HDR) {
+        printk(KERN_WARNING "scull: scull_mq_buffer too small\n");
+        return 0;
+    }
+    scull_mq_buffer = roundup_pow_of_two(scull_mq_buffer); /* for the ring masks */
+
+    result = register_chrdev_region(firstdev, scull_mq_nr_devs, "scullmq");
+    if (result < 0) {
+        printk(KERN_NOTICE "Unable to get scullmq region, error %d\n", result);
+        return 0;
+    }
+    scull_mq_devno = firstdev;
+    scull_mq_devices = kmalloc(scull_mq_nr_devs * sizeof(struct scull_mq), GFP_KERNEL);
+    if (scull_mq_devices == NULL) {
+        unregister_chrdev_region(firstdev, scull_mq_nr_devs);
+        return 0;
+    }
+    memset(scull_mq_devices, 0, scull_mq_nr_devs * sizeof(struct scull_mq));
+    for (int i = 0; i < scull_mq_nr_devs; i++) {
+        init_waitqueue_head(&(scull_mq_devices[i].inq));
+        init_waitqueue_head(&(scull_mq_devices[i].outq));
+        mutex_init(&scull_mq_devices[i].lock);
+        sema_init(&scull_mq_devices[i].sem, 1);
+        scull_mq_setup_cdev(scull_mq_devices + i, i);
+    }
+    return scull_mq_nr_devs;
+}
+
+/*
+ * This is called by cleanup_module or on failure.
+ * It is required to never fail, even if nothing was initialized first
+ */
+void scull_mq_cleanup(void)
+{
+    if (!scull_mq_devices)
+        return; /* nothing else to release */
+
+    for (int i = 0; i < scull_mq_nr_devs; i++) {
+        device_destroy(scull_class, scull_mq_devno + i);
+        cdev_del(&scull_mq_devices[i].cdev);
+        scull_mq_free_rings(scull_mq_devices + i);
+    }
+    kfree(scull_mq_devices);
+    unregister_chrdev_region(scull_mq_devno, scull_mq_nr_devs);
+    scull_mq_devices = NULL; /* pedantic */
+}
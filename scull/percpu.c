@@ -0,0 +1,461 @@
+/*
+ * percpu.c -- per-CPU ingestion driver for scull
+ *
+ * Fire-and-forget record intake that scales with the number of CPUs: a
+ * writer appends to the ring of the CPU it runs on and never touches a
+ * cache line another CPU writes to, unless it migrates midway or wakes a
+ * sleeping reader.  Readers merge the rings lazily, either by timestamp
+ * or grouped per CPU, so all the ordering work is paid at read time.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk(), min() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/vmalloc.h>	/* vmalloc_node() */
+#include <linux/percpu.h>	/* alloc_percpu() */
+#include <linux/sched/clock.h>	/* local_clock() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/fcntl.h>
+#include <linux/poll.h>
+#include <linux/cdev.h>
+#include <linux/device.h>	/* device_create() */
+#include <linux/sched/signal.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>		/* roundup_pow_of_two() */
+
+#include <linux/uaccess.h>	/* copy_*_user */
+
+#include "scull.h"
+
+/*
+ * One CPU's ring.  Writers running on the CPU serialize on "lock" (only a
+ * writer that migrated meanwhile ever contends for it) and publish "in";
+ * the reader publishes "out", which lives on a cache line of its own.
+ * Records are 16-byte aligned, so a header never wraps around the end.
+ */
+struct scull_pc_cpu {
+    struct mutex lock;              /* serializes writers */
+    char *buffer;
+    unsigned int in;                /* producer index, free running */
+    unsigned long dropped;          /* records that found the ring full */
+    unsigned int out ____cacheline_aligned_in_smp; /* consumer index */
+};
+
+/* A record in a ring: the payload follows the header */
+struct scull_pc_hdr {
+    __u64 ts;                       /* local_clock() when it was queued */
+    __u32 len;
+    __u32 cpu;
+};
+
+#define SCULL_PC_ALIGN  sizeof(struct scull_pc_hdr)
+#define SCULL_PC_SPACE(len)  ALIGN(sizeof(struct scull_pc_hdr) + (len), SCULL_PC_ALIGN)
+
+struct scull_pcpu {
+    struct scull_pc_cpu __percpu *cpus;
+    wait_queue_head_t inq;          /* readers wait here */
+    struct mutex rlock;             /* one reader drains at a time */
+    int nopen;                      /* number of openings */
+    struct semaphore sem;           /* protects open/release bookkeeping */
+    struct cdev cdev;               /* Char device structure */
+};
+
+struct scull_pc_file {
+    struct scull_pcpu *dev;
+    int order;                      /* SCULL_PC_ORDER_* */
+};
+
+/* parameters */
+static int scull_pc_nr_devs = SCULL_PC_NR_DEVS;  /* number of devices */
+int scull_pc_buffer = SCULL_PC_BUFFER;           /* ring size, per CPU */
+static dev_t scull_pc_devno;                     /* Our first device number */
+
+module_param(scull_pc_nr_devs, int, S_IRUGO);
+module_param(scull_pc_buffer, int, S_IRUGO);
+
+static struct scull_pcpu *scull_pc_devices;
+
+/* ---------------------- ring helpers ---------------------- */
+
+/*
+ * Copy between user space and a ring at byte position "pos", in two
+ * pieces if the range wraps.  Return nonzero on fault, like copy_*_user.
+ */
+static int scull_pc_copy_in(char *buffer, unsigned int pos,
+        const char __user *buf, size_t len)
+{
+    unsigned int off = pos & (scull_pc_buffer - 1);
+    size_t l = min_t(size_t, len, scull_pc_buffer - off);
+
+    return copy_from_user(buffer + off, buf, l) ||
+        copy_from_user(buffer, buf + l, len - l);
+}
+
+static int scull_pc_copy_out(char *buffer, unsigned int pos,
+        char __user *buf, size_t len)
+{
+    unsigned int off = pos & (scull_pc_buffer - 1);
+    size_t l = min_t(size_t, len, scull_pc_buffer - off);
+
+    return copy_to_user(buf, buffer + off, l) ||
+        copy_to_user(buf + l, buffer, len - l);
+}
+
+/* The record at the head of a ring, or NULL if it is empty */
+static struct scull_pc_hdr *scull_pc_head(struct scull_pc_cpu *c)
+{
+    unsigned int in = smp_load_acquire(&c->in); /* see the records, too */
+
+    if (in == c->out)
+        return NULL;
+    return (struct scull_pc_hdr *)(c->buffer + (c->out & (scull_pc_buffer - 1)));
+}
+
+/*
+ * Pick the ring to read from next: the one whose head record is oldest,
+ * or the first non-empty one for SCULL_PC_ORDER_CPU.  A linear scan of
+ * the heads; it only runs on the read side.
+ */
+static struct scull_pc_cpu *scull_pc_next(struct scull_pcpu *dev, int order,
+        struct scull_pc_hdr **hp)
+{
+    struct scull_pc_cpu *best = NULL;
+    struct scull_pc_hdr *h;
+    int cpu;
+
+    *hp = NULL;
+    for_each_possible_cpu(cpu) {
+        struct scull_pc_cpu *c = per_cpu_ptr(dev->cpus, cpu);
+
+        h = scull_pc_head(c);
+        if (!h || (*hp && h->ts >= (*hp)->ts))
+            continue;
+        best = c;
+        *hp = h;
+        if (order == SCULL_PC_ORDER_CPU)
+            break;
+    }
+    return best;
+}
+
+static bool scull_pc_empty(struct scull_pcpu *dev)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        if (scull_pc_head(per_cpu_ptr(dev->cpus, cpu)))
+            return false;
+    return true;
+}
+
+/* ---------------------- file operations ---------------------- */
+
+static void scull_pc_free_rings(struct scull_pcpu *dev)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct scull_pc_cpu *c = per_cpu_ptr(dev->cpus, cpu);
+
+        vfree(c->buffer);
+        c->buffer = NULL;
+    }
+}
+
+static int scull_pc_open(struct inode *inode, struct file *filp)
+{
+    struct scull_pcpu *dev;
+    struct scull_pc_file *pf;
+    int cpu;
+
+    dev = container_of(inode->i_cdev, struct scull_pcpu, cdev);
+
+    pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+    if (!pf)
+        return -ENOMEM;
+    pf->dev = dev;                  /* and SCULL_PC_ORDER_TIME */
+    filp->private_data = pf;
+
+    if (down_interruptible(&dev->sem)) {
+        kfree(pf);
+        return -ERESTARTSYS;
+    }
+    if (!dev->nopen) {
+        /* allocate the rings, each on its CPU's node */
+        for_each_possible_cpu(cpu) {
+            struct scull_pc_cpu *c = per_cpu_ptr(dev->cpus, cpu);
+
+            c->buffer = vmalloc_node(scull_pc_buffer, cpu_to_node(cpu));
+            if (!c->buffer) {
+                scull_pc_free_rings(dev);
+                up(&dev->sem);
+                kfree(pf);
+                return -ENOMEM;
+            }
+            c->in = c->out = 0;
+            c->dropped = 0;
+        }
+    }
+    dev->nopen++;
+    up(&dev->sem);
+
+    return nonseekable_open(inode, filp);
+}
+
+static int scull_pc_release(struct inode *inode, struct file *filp)
+{
+    struct scull_pc_file *pf = filp->private_data;
+    struct scull_pcpu *dev = pf->dev;
+
+    down(&dev->sem);
+    if (--dev->nopen == 0)
+        scull_pc_free_rings(dev);
+    up(&dev->sem);
+    kfree(pf);
+    return 0;
+}
+
+/*
+ * Read as many whole records as fit, each as a struct scull_pc_rec
+ * followed by its payload, padded to 8 bytes.
+ */
+static ssize_t scull_pc_read(struct file *filp, char __user *buf, size_t count,
+        loff_t *f_pos)
+{
+    struct scull_pc_file *pf = filp->private_data;
+    struct scull_pcpu *dev = pf->dev;
+    int order = READ_ONCE(pf->order);
+    struct scull_pc_cpu *c;
+    struct scull_pc_hdr *h;
+    size_t done = 0;
+    ssize_t retval = 0;
+
+    if (mutex_lock_interruptible(&dev->rlock))
+        return -ERESTARTSYS;
+    while (scull_pc_empty(dev)) { /* nothing to read */
+        mutex_unlock(&dev->rlock);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->inq, !scull_pc_empty(dev)))
+            return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+        if (mutex_lock_interruptible(&dev->rlock))
+            return -ERESTARTSYS;
+    }
+
+    while ((c = scull_pc_next(dev, order, &h)) != NULL) {
+        struct scull_pc_rec rec = { .ts = h->ts, .cpu = h->cpu, .len = h->len };
+        size_t space = ALIGN(sizeof(rec) + rec.len, 8);
+
+        if (space > count - done)
+            break;
+        if (copy_to_user(buf + done, &rec, sizeof(rec)) ||
+                scull_pc_copy_out(c->buffer, c->out + sizeof(*h),
+                    buf + done + sizeof(rec), rec.len)) {
+            retval = -EFAULT;
+            break;
+        }
+        /* the data is out: give the room back to the writers */
+        smp_store_release(&c->out, c->out + SCULL_PC_SPACE(rec.len));
+        done += space;
+    }
+    mutex_unlock(&dev->rlock);
+
+    if (done)
+        return done;
+    return retval ? retval : -EMSGSIZE; /* the first record does not fit */
+}
+
+/*
+ * Queue one record on this CPU's ring.  Writers never wait: a record
+ * that finds the ring full is dropped and counted, and -ENOBUFS returned.
+ */
+static ssize_t scull_pc_write(struct file *filp, const char __user *buf,
+        size_t count, loff_t *f_pos)
+{
+    struct scull_pc_file *pf = filp->private_data;
+    struct scull_pcpu *dev = pf->dev;
+    struct scull_pc_cpu *c;
+    struct scull_pc_hdr *h;
+    unsigned int space = SCULL_PC_SPACE(count);
+    int cpu;
+
+    if (count > scull_pc_buffer - sizeof(*h))
+        return -EMSGSIZE;
+
+    /* a migration after this only costs a remote cache line */
+    cpu = raw_smp_processor_id();
+    c = per_cpu_ptr(dev->cpus, cpu);
+
+    if (mutex_lock_interruptible(&c->lock))
+        return -ERESTARTSYS;
+    if (scull_pc_buffer - (c->in - smp_load_acquire(&c->out)) < space) {
+        c->dropped++;
+        mutex_unlock(&c->lock);
+        return -ENOBUFS;
+    }
+    if (scull_pc_copy_in(c->buffer, c->in + sizeof(*h), buf, count)) {
+        mutex_unlock(&c->lock);
+        return -EFAULT;
+    }
+    h = (struct scull_pc_hdr *)(c->buffer + (c->in & (scull_pc_buffer - 1)));
+    h->ts = local_clock();
+    h->len = count;
+    h->cpu = cpu;
+    smp_store_release(&c->in, c->in + space); /* publish the record */
+    mutex_unlock(&c->lock);
+
+    /* finally, awake any reader (wq_has_sleeper() orders against it) */
+    if (wq_has_sleeper(&dev->inq))
+        wake_up_interruptible(&dev->inq);
+    return count;
+}
+
+static __poll_t scull_pc_poll(struct file *filp, poll_table *wait)
+{
+    struct scull_pc_file *pf = filp->private_data;
+    struct scull_pcpu *dev = pf->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM; /* writers never wait */
+
+    poll_wait(filp, &dev->inq, wait);
+    if (!scull_pc_empty(dev))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+/*
+ * The ioctl() implementation
+ */
+static long scull_pc_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_pc_file *pf = filp->private_data;
+    struct scull_pcpu *dev = pf->dev;
+    u64 dropped = 0;
+    int cpu;
+
+    if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
+    if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
+
+    switch (cmd) {
+    case SCULL_PC_IOCSORDER: /* Set: arg is the value */
+        if (arg != SCULL_PC_ORDER_TIME && arg != SCULL_PC_ORDER_CPU)
+            return -EINVAL;
+        WRITE_ONCE(pf->order, arg);
+        return 0;
+
+    case SCULL_PC_IOCQORDER: /* Query: return it (it's positive) */
+        return READ_ONCE(pf->order);
+
+    case SCULL_PC_IOCGDROPPED: /* Get: the sum over all CPUs */
+        for_each_possible_cpu(cpu)
+            dropped += READ_ONCE(per_cpu_ptr(dev->cpus, cpu)->dropped);
+        return put_user(dropped, (u64 __user *)arg);
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * The file operations for the per-CPU device
+ */
+struct file_operations scull_pcpu_fops = {
+    .owner = THIS_MODULE,
+    .read = scull_pc_read,
+    .write = scull_pc_write,
+    .poll = scull_pc_poll,
+    .unlocked_ioctl = scull_pc_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .open = scull_pc_open,
+    .release = scull_pc_release,
+};
+
+/*
+ * Set up a cdev entry.
+ */
+static void scull_pc_setup_cdev(struct scull_pcpu *dev, int index)
+{
+    int err, devno = scull_pc_devno + index;
+
+    cdev_init(&dev->cdev, &scull_pcpu_fops);
+    dev->cdev.owner = THIS_MODULE;
+    err = cdev_add(&dev->cdev, devno, 1);
+    /* Fail gracefully if need be */
+    if (err)
+        printk(KERN_NOTICE "Error %d adding scullcpu%d", err, index);
+    else
+        device_create(scull_class, NULL, devno, NULL, "scullcpu%d", index);
+}
+
+/*
+ * Initialize the devices; return how many we did.
+ */
+int scull_pc_init(dev_t firstdev)
+{
+    int result, cpu;
+
+    if (scull_pc_buffer < 2 * (int)SCULL_PC_ALIGN) {
+        printk(KERN_WARNING "scull: scull_pc_buffer too small\n");
+        return 0;
+    }
+    scull_pc_buffer = roundup_pow_of_two(scull_pc_buffer); /* for the ring masks */
+
+    result = register_chrdev_region(firstdev, scull_pc_nr_devs, "scullcpu");
+    if (result < 0) {
+        printk(KERN_NOTICE "Unable to get scullcpu region, error %d\n", result);
+        return 0;
+    }
+    scull_pc_devno = firstdev;
+    scull_pc_devices = kmalloc(scull_pc_nr_devs * sizeof(struct scull_pcpu), GFP_KERNEL);
+    if (scull_pc_devices == NULL) {
+        unregister_chrdev_region(firstdev, scull_pc_nr_devs);
+        return 0;
+    }
+    memset(scull_pc_devices, 0, scull_pc_nr_devs * sizeof(struct scull_pcpu));
+    for (int i = 0; i < scull_pc_nr_devs; i++) {
+        scull_pc_devices[i].cpus = alloc_percpu(struct scull_pc_cpu);
+        if (!scull_pc_devices[i].cpus) {
+            while (i--)
+                free_percpu(scull_pc_devices[i].cpus);
+            kfree(scull_pc_devices);
+            scull_pc_devices = NULL;
+            unregister_chrdev_region(firstdev, scull_pc_nr_devs);
+            return 0;
+        }
+    }
+    for (int i = 0; i < scull_pc_nr_devs; i++) {
+        struct scull_pcpu *dev = scull_pc_devices + i;
+
+        for_each_possible_cpu(cpu)
+            mutex_init(&per_cpu_ptr(dev->cpus, cpu)->lock);
+        init_waitqueue_head(&dev->inq);
+        mutex_init(&dev->rlock);
+        sema_init(&dev->sem, 1);
+        scull_pc_setup_cdev(dev, i);
+    }
+    return scull_pc_nr_devs;
+}
+
+/*
+ * This is called by cleanup_module or on failure.
+ * It is required to never fail, even if nothing was initialized first
+ */
+void scull_pc_cleanup(void)
+{
+    if (!scull_pc_devices)
+        return; /* nothing else to release */
+
+    for (int i = 0; i < scull_pc_nr_devs; i++) {
+        device_destroy(scull_class, scull_pc_devno + i);
+        cdev_del(&scull_pc_devices[i].cdev);
+        scull_pc_free_rings(scull_pc_devices + i);
+        free_percpu(scull_pc_devices[i].cpus);
+    }
+    kfree(scull_pc_devices);
+    unregister_chrdev_region(scull_pc_devno, scull_pc_nr_devs);
+    scull_pc_devices = NULL; /* pedantic */
+}
@@ -0,0 +1,672 @@
+/*
+ * pipe.c -- fifo driver for scull
+ *
+ * A producer/consumer device built on a fixed-size ring buffer:
+ * readers sleep while it is empty, writers while it is full, and .poll
+ * lets a process wait on many of them at once with select/poll/epoll.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk(), min() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/fcntl.h>
+#include <linux/poll.h>
+#include <linux/cdev.h>
+#include <linux/device.h>	/* device_create() */
+#include <linux/sched/signal.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/list.h>
+#include <linux/atomic.h>
+#include <linux/sched/clock.h>	/* local_clock() */
+#include <linux/log2.h>	/* roundup_pow_of_two() */
+#include <linux/vmalloc.h>	/* vmalloc_user() */
+#include <linux/mm.h>		/* remap_vmalloc_range() */
+
+#include <linux/uaccess.h>	/* copy_*_user */
+
+#include "scull.h"
+
+/*
+ * The ring follows kfifo: "in" and "out" are free-running indices, masked
+ * with buffersize - 1 on access, so the buffer size is a power of two and
+ * no byte is wasted to tell full from empty.  Only the producer moves "in"
+ * and only the consumer moves "out", publishing with release stores that
+ * the other side pairs with acquire loads; the data itself needs no lock.
+ * In the default mode, writers serialize among themselves on wlock and
+ * readers on rlock; in SPSC mode there is exactly one of each and neither
+ * mutex is taken.
+ *
+ * The indices live in the first page of a vmalloc'ed area, the data pages
+ * follow, and the whole area can be mmap'ed: a producer or consumer that
+ * maps it exchanges data with no syscalls at all, and only comes back to
+ * the kernel to sleep (poll, SCULL_P_IOCWAIT*) or to wake a sleeper
+ * (SCULL_P_IOCWAKE) when ring->rd_wait/wr_wait say there is one.
+ */
+struct scull_pipe {
+    struct scull_p_ring *ring;      /* indices, shared with user space */
+    atomic_t msgs;                  /* writes since the ring was last drained */
+    wait_queue_head_t inq, outq;    /* read and write queues */
+    char *buffer;                   /* the ring data, after the index page */
+    unsigned int buffersize;        /* a power of two */
+    bool spsc;                      /* single producer, single consumer */
+    int nreaders, nwriters;         /* number of openings for r/w */
+    struct list_head readers;       /* scull_p_files open for reading */
+    unsigned int coal_bytes;        /* lowest reader watermarks, see below */
+    unsigned int coal_msgs;
+    bool coal_count;                /* some reader has a message watermark */
+    u64 coal_delay;                 /* shortest reader max delay, ns */
+    struct hrtimer coal_timer;      /* bounds how long a wakeup is held back */
+    unsigned long coal_armed;       /* bit 0: coal_timer is pending */
+    bool coal_expired;              /* coal_timer fired since the last read */
+    atomic64_t wakeups_avoided;     /* reader wakeups coalesced away */
+    struct mutex rlock, wlock;      /* serialize readers, writers */
+    struct semaphore sem;           /* protects open/release bookkeeping */
+    struct cdev cdev;               /* Char device structure */
+};
+
+/*
+ * Per-open-file state.  Readers may ask for their wakeups to be coalesced,
+ * like NIC interrupt coalescing: a sleeping reader is only woken once a
+ * byte or message (write) watermark is reached, or once the maximum delay
+ * after the first held-back wakeup has passed.  Writers check the lowest
+ * watermarks of all readers (kept in the scull_pipe), so a tiny write
+ * that no reader wants to see yet costs no wakeup at all.
+ */
+struct scull_p_file {
+    struct scull_pipe *dev;
+    struct list_head list;          /* on dev->readers */
+    struct scull_p_coalesce coal;   /* this reader's watermarks */
+    unsigned int busy_poll_us;      /* spin this long before sleeping */
+};
+
+/* parameters */
+static int scull_p_nr_devs = SCULL_P_NR_DEVS;  /* number of pipe devices */
+int scull_p_buffer = SCULL_P_BUFFER;           /* buffer size */
+static dev_t scull_p_devno;                    /* Our first device number */
+
+module_param(scull_p_nr_devs, int, S_IRUGO);
+module_param(scull_p_buffer, int, S_IRUGO);
+
+static struct scull_pipe *scull_p_devices;
+
+static void scull_p_update_coalesce(struct scull_pipe *dev);
+
+/*
+ * Open and close
+ */
+static int scull_p_open(struct inode *inode, struct file *filp)
+{
+    struct scull_pipe *dev;
+    struct scull_p_file *pf;
+
+    dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
+
+    pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+    if (!pf)
+        return -ENOMEM;
+    pf->dev = dev;
+    pf->coal.bytes = pf->coal.msgs = 1;  /* no coalescing */
+    INIT_LIST_HEAD(&pf->list);
+    filp->private_data = pf;
+
+    if (down_interruptible(&dev->sem)) {
+        kfree(pf);
+        return -ERESTARTSYS;
+    }
+
+    /* an SPSC pipe admits a single reader and a single writer */
+    if (dev->spsc && (((filp->f_mode & FMODE_READ) && dev->nreaders) ||
+                ((filp->f_mode & FMODE_WRITE) && dev->nwriters))) {
+        up(&dev->sem);
+        kfree(pf);
+        return -EBUSY;
+    }
+
+    if (!dev->ring) {
+        /* allocate the index page and the buffer, zeroed, mappable */
+        dev->ring = vmalloc_user(PAGE_SIZE + scull_p_buffer);
+        if (!dev->ring) {
+            up(&dev->sem);
+            kfree(pf);
+            return -ENOMEM;
+        }
+        atomic_set(&dev->msgs, 0);
+        dev->buffer = (char *)dev->ring + PAGE_SIZE;
+        dev->buffersize = scull_p_buffer;
+        dev->ring->size = scull_p_buffer; /* in = out = 0: rd and wr from the beginning */
+    }
+
+    /* use f_mode, not f_flags: it's cleaner (fs/open.c tells why) */
+    if (filp->f_mode & FMODE_READ) {
+        dev->nreaders++;
+        list_add(&pf->list, &dev->readers);
+    }
+    if (filp->f_mode & FMODE_WRITE)
+        dev->nwriters++;
+    scull_p_update_coalesce(dev);
+    up(&dev->sem);
+
+    return nonseekable_open(inode, filp);
+}
+
+static int scull_p_release(struct inode *inode, struct file *filp)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+
+    down(&dev->sem);
+    if (filp->f_mode & FMODE_READ) {
+        dev->nreaders--;
+        list_del(&pf->list);
+    }
+    if (filp->f_mode & FMODE_WRITE)
+        dev->nwriters--;
+    scull_p_update_coalesce(dev);
+    if (dev->nreaders + dev->nwriters == 0) {
+        hrtimer_cancel(&dev->coal_timer);
+        clear_bit(0, &dev->coal_armed);
+        dev->coal_expired = false;
+        vfree(dev->ring);  /* mappings hold the file, so they are gone too */
+        dev->ring = NULL;  /* the other fields are not checked on open */
+        dev->buffer = NULL;
+        dev->spsc = false;
+    }
+    up(&dev->sem);
+    kfree(pf);
+    return 0;
+}
+
+/*
+ * How much data is there, and how much space is free?  The indices are
+ * clamped, so a misbehaving peer (racing on a shared file, or scribbling
+ * on the mapped index page) can corrupt the stream but never make us copy
+ * outside the buffer.
+ */
+static unsigned int scull_p_used(struct scull_pipe *dev)
+{
+    return min(smp_load_acquire(&dev->ring->in) - READ_ONCE(dev->ring->out),
+            dev->buffersize);
+}
+
+static unsigned int scull_p_free(struct scull_pipe *dev)
+{
+    return dev->buffersize -
+        min(READ_ONCE(dev->ring->in) - smp_load_acquire(&dev->ring->out),
+                dev->buffersize);
+}
+
+/*
+ * Is there enough for this reader?  Without coalescing anything is enough;
+ * with it, the reader's byte or message watermark must be reached, unless
+ * the maximum delay has already expired.
+ */
+static bool scull_p_ready(struct scull_p_file *pf)
+{
+    struct scull_pipe *dev = pf->dev;
+    unsigned int used = scull_p_used(dev);
+
+    if (!used)
+        return false;
+    return used >= min(pf->coal.bytes, dev->buffersize) || pf->coal.msgs <= 1 ||
+        atomic_read(&dev->msgs) >= pf->coal.msgs ||
+        READ_ONCE(dev->coal_expired);
+}
+
+/*
+ * Busy-poll for data, SO_BUSY_POLL style: spin for up to the reader's
+ * budget before going to sleep, trading CPU time for the scheduler's
+ * wakeup latency.  Gives up early if something else wants the CPU.
+ */
+static bool scull_p_busy_poll(struct scull_p_file *pf)
+{
+    unsigned int budget = READ_ONCE(pf->busy_poll_us);
+    u64 end;
+
+    if (!budget)
+        return false;
+
+    end = local_clock() + (u64)budget * NSEC_PER_USEC;
+    do {
+        if (scull_p_ready(pf))
+            return true;
+        if (need_resched() || signal_pending(current))
+            break;
+        cpu_relax();
+    } while (local_clock() < end);
+    return scull_p_ready(pf);
+}
+
+/*
+ * Wait conditions.  Before checking, a sleeper raises its flag in the
+ * shared page, so that a producer or consumer working on the mapping
+ * knows to issue SCULL_P_IOCWAKE after moving its index.  The full
+ * barrier pairs with the one user space must put between its index
+ * store and its flag load.
+ */
+static bool scull_p_readable(struct scull_p_file *pf)
+{
+    struct scull_pipe *dev = pf->dev;
+
+    if (scull_p_ready(pf))
+        return true;
+    WRITE_ONCE(dev->ring->rd_wait, 1);
+    smp_mb();
+    return scull_p_ready(pf);
+}
+
+static bool scull_p_writable(struct scull_pipe *dev)
+{
+    if (scull_p_free(dev))
+        return true;
+    WRITE_ONCE(dev->ring->wr_wait, 1);
+    smp_mb();
+    return scull_p_free(dev) != 0;
+}
+
+/* Wake the readers (or writers) asleep on "wq", if there are any */
+static void scull_p_wake(wait_queue_head_t *wq, __u32 *flag)
+{
+    if (wq_has_sleeper(wq)) {
+        WRITE_ONCE(*flag, 0);   /* sleepers that stay asleep set it again */
+        wake_up_interruptible(wq);
+    }
+}
+
+/*
+ * After a write: wake the readers if the lowest watermarks are reached,
+ * otherwise hold the wakeup back, at most until coal_timer fires.  Writes
+ * are only counted while a reader has a message watermark: the counter
+ * is on a cache line the reader writes too, which the SPSC path and the
+ * uncoalesced one can do without.
+ */
+static void scull_p_wake_readers(struct scull_pipe *dev)
+{
+    bool counting = READ_ONCE(dev->coal_count);
+    unsigned int msgs = counting ? atomic_inc_return(&dev->msgs) : 0;
+    u64 delay;
+
+    if (!counting || scull_p_used(dev) >= READ_ONCE(dev->coal_bytes) ||
+            msgs >= READ_ONCE(dev->coal_msgs)) {
+        scull_p_wake(&dev->inq, &dev->ring->rd_wait);
+        return;
+    }
+    if (!wq_has_sleeper(&dev->inq))
+        return;
+
+    atomic64_inc(&dev->wakeups_avoided);
+    delay = READ_ONCE(dev->coal_delay);
+    if (delay && !test_and_set_bit(0, &dev->coal_armed))
+        hrtimer_start(&dev->coal_timer, ns_to_ktime(delay), HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart scull_p_coalesce_expired(struct hrtimer *timer)
+{
+    struct scull_pipe *dev = container_of(timer, struct scull_pipe, coal_timer);
+
+    WRITE_ONCE(dev->coal_expired, true);
+    clear_bit(0, &dev->coal_armed);
+    scull_p_wake(&dev->inq, &dev->ring->rd_wait);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Recompute the lowest watermarks and the shortest delay over all the
+ * readers, which is what writers check.  Called with dev->sem held.
+ */
+static void scull_p_update_coalesce(struct scull_pipe *dev)
+{
+    struct scull_p_file *pf;
+    unsigned int bytes = UINT_MAX, msgs = UINT_MAX;
+    bool count = false;
+    u64 delay = 0;
+
+    list_for_each_entry(pf, &dev->readers, list) {
+        bytes = min(bytes, pf->coal.bytes);
+        msgs = min(msgs, pf->coal.msgs);
+        count |= pf->coal.msgs > 1;
+        if (pf->coal.delay_ns && (!delay || pf->coal.delay_ns < delay))
+            delay = pf->coal.delay_ns;
+    }
+    if (list_empty(&dev->readers))
+        bytes = msgs = 1;
+
+    WRITE_ONCE(dev->coal_bytes, min(bytes, dev->buffersize));
+    WRITE_ONCE(dev->coal_msgs, msgs);
+    WRITE_ONCE(dev->coal_count, count);
+    WRITE_ONCE(dev->coal_delay, delay);
+}
+
+static int scull_p_lock(struct mutex *lock, bool spsc)
+{
+    if (spsc)
+        return 0;
+    return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+static void scull_p_unlock(struct mutex *lock, bool spsc)
+{
+    if (!spsc)
+        mutex_unlock(lock);
+}
+
+/*
+ * Data management: read and write
+ */
+static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count,
+        loff_t *f_pos)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    bool spsc = READ_ONCE(dev->spsc);
+    unsigned int out, off, l;
+
+    if (scull_p_lock(&dev->rlock, spsc))
+        return -ERESTARTSYS;
+
+    /* non-blocking readers take whatever is there, others wait for enough */
+    while (filp->f_flags & O_NONBLOCK ? !scull_p_used(dev) : !scull_p_ready(pf)) {
+        scull_p_unlock(&dev->rlock, spsc); /* release the lock */
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (!scull_p_busy_poll(pf) &&
+                wait_event_interruptible(dev->inq, scull_p_readable(pf)))
+            return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+        /* otherwise loop, but first reacquire the lock */
+        if (scull_p_lock(&dev->rlock, spsc))
+            return -ERESTARTSYS;
+    }
+
+    /* ok, data is there, return something, in two pieces if it wraps */
+    count = min_t(size_t, count, scull_p_used(dev));
+    out = READ_ONCE(dev->ring->out);
+    off = out & (dev->buffersize - 1);
+    l = min_t(size_t, count, dev->buffersize - off);
+    if (copy_to_user(buf, dev->buffer + off, l) ||
+            copy_to_user(buf + l, dev->buffer, count - l)) {
+        scull_p_unlock(&dev->rlock, spsc);
+        return -EFAULT;
+    }
+    smp_store_release(&dev->ring->out, out + count);
+    if (READ_ONCE(dev->coal_count) && !scull_p_used(dev))
+        atomic_set(&dev->msgs, 0);     /* drained: start counting afresh */
+    if (READ_ONCE(dev->coal_expired))
+        WRITE_ONCE(dev->coal_expired, false);
+    scull_p_unlock(&dev->rlock, spsc);
+
+    /* finally, awake any writers that are actually asleep, and return */
+    scull_p_wake(&dev->outq, &dev->ring->wr_wait);
+    return count;
+}
+
+/* Wait for space for writing; caller must hold wlock (unless SPSC).  On
+ * error the lock will be released before returning. */
+static int scull_getwritespace(struct scull_pipe *dev, struct file *filp, bool spsc)
+{
+    while (!scull_p_free(dev)) { /* full */
+        scull_p_unlock(&dev->wlock, spsc);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->outq, scull_p_writable(dev)))
+            return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+        if (scull_p_lock(&dev->wlock, spsc))
+            return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+static ssize_t scull_p_write(struct file *filp, const char __user *buf,
+        size_t count, loff_t *f_pos)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    bool spsc = READ_ONCE(dev->spsc);
+    unsigned int in, off, l;
+    int result;
+
+    if (scull_p_lock(&dev->wlock, spsc))
+        return -ERESTARTSYS;
+
+    /* Make sure there's space to write */
+    result = scull_getwritespace(dev, filp, spsc);
+    if (result)
+        return result; /* scull_getwritespace released the lock */
+
+    /* ok, space is there, accept something, in two pieces if it wraps */
+    count = min_t(size_t, count, scull_p_free(dev));
+    in = READ_ONCE(dev->ring->in);
+    off = in & (dev->buffersize - 1);
+    l = min_t(size_t, count, dev->buffersize - off);
+    if (copy_from_user(dev->buffer + off, buf, l) ||
+            copy_from_user(dev->buffer, buf + l, count - l)) {
+        scull_p_unlock(&dev->wlock, spsc);
+        return -EFAULT;
+    }
+    smp_store_release(&dev->ring->in, in + count);
+    scull_p_unlock(&dev->wlock, spsc);
+
+    /* finally, awake any reader that is asleep and wants to see this */
+    scull_p_wake_readers(dev);  /* blocked in read() and select() */
+    return count;
+}
+
+static __poll_t scull_p_poll(struct file *filp, poll_table *wait)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &dev->inq,  wait);
+    poll_wait(filp, &dev->outq, wait);
+    if (scull_p_readable(pf))
+        mask |= EPOLLIN | EPOLLRDNORM;   /* readable */
+    if (scull_p_writable(dev))
+        mask |= EPOLLOUT | EPOLLWRNORM;  /* writable */
+    return mask;
+}
+
+/*
+ * Map the index page and the ring, in that order, for a syscall-free
+ * producer or consumer.  Each side of the mapping must be the only
+ * producer (or consumer): the kernel cannot serialize stores it does
+ * not see.
+ */
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct scull_pipe *dev = ((struct scull_p_file *)filp->private_data)->dev;
+
+    if (vma->vm_pgoff ||
+            vma->vm_end - vma->vm_start != PAGE_SIZE + dev->buffersize)
+        return -EINVAL;
+    return remap_vmalloc_range(vma, dev->ring, 0);
+}
+
+/*
+ * The ioctl() implementation: switch between the default locked mode and
+ * the lock-free single-producer/single-consumer mode.
+ */
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    struct scull_p_coalesce coal;
+    u64 avoided;
+    long retval = 0;
+
+    if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
+    if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
+
+    switch (cmd) {
+    case SCULL_P_IOCSMODE: /* Set: arg is the value */
+        if (arg != SCULL_P_MODE_DEFAULT && arg != SCULL_P_MODE_SPSC)
+            return -EINVAL;
+        if (down_interruptible(&dev->sem))
+            return -ERESTARTSYS;
+        if (arg == SCULL_P_MODE_SPSC && (dev->nreaders > 1 || dev->nwriters > 1))
+            retval = -EBUSY;
+        else
+            WRITE_ONCE(dev->spsc, arg == SCULL_P_MODE_SPSC);
+        up(&dev->sem);
+        break;
+
+    case SCULL_P_IOCQMODE: /* Query: return it (it's positive) */
+        retval = READ_ONCE(dev->spsc) ? SCULL_P_MODE_SPSC : SCULL_P_MODE_DEFAULT;
+        break;
+
+    case SCULL_P_IOCWAKE: /* a mapped peer moved an index: wake sleepers */
+        scull_p_wake(&dev->inq, &dev->ring->rd_wait);
+        scull_p_wake(&dev->outq, &dev->ring->wr_wait);
+        break;
+
+    case SCULL_P_IOCWAITRD: /* a mapped consumer went idle */
+        if (filp->f_flags & O_NONBLOCK)
+            return scull_p_readable(pf) ? 0 : -EAGAIN;
+        if (!scull_p_busy_poll(pf) &&
+                wait_event_interruptible(dev->inq, scull_p_readable(pf)))
+            return -ERESTARTSYS;
+        break;
+
+    case SCULL_P_IOCWAITWR: /* a mapped producer found the ring full */
+        if (filp->f_flags & O_NONBLOCK)
+            return scull_p_writable(dev) ? 0 : -EAGAIN;
+        if (wait_event_interruptible(dev->outq, scull_p_writable(dev)))
+            return -ERESTARTSYS;
+        break;
+
+    case SCULL_P_IOCSCOALESCE: /* Set: arg points to the value */
+        if (!(filp->f_mode & FMODE_READ))
+            return -EINVAL;
+        if (copy_from_user(&coal, (void __user *)arg, sizeof(coal)))
+            return -EFAULT;
+        if (down_interruptible(&dev->sem))
+            return -ERESTARTSYS;
+        pf->coal.bytes = max(coal.bytes, 1U);
+        pf->coal.msgs = max(coal.msgs, 1U);
+        pf->coal.delay_ns = coal.delay_ns;
+        scull_p_update_coalesce(dev);
+        up(&dev->sem);
+        break;
+
+    case SCULL_P_IOCGCOALESCE: /* Get: arg is pointer to result */
+        if (copy_to_user((void __user *)arg, &pf->coal, sizeof(pf->coal)))
+            return -EFAULT;
+        break;
+
+    case SCULL_P_IOCSBUSYPOLL: /* Tell: arg is the value, in microseconds */
+        if (arg > SCULL_P_BUSY_POLL_MAX)
+            return -EINVAL;
+        WRITE_ONCE(pf->busy_poll_us, arg);
+        break;
+
+    case SCULL_P_IOCQBUSYPOLL: /* Query: return it (it's positive) */
+        retval = READ_ONCE(pf->busy_poll_us);
+        break;
+
+    case SCULL_P_IOCGAVOIDED: /* Get: arg is pointer to result */
+        avoided = atomic64_read(&dev->wakeups_avoided);
+        if (put_user(avoided, (u64 __user *)arg))
+            return -EFAULT;
+        break;
+
+    default:
+        return -ENOTTY;
+    }
+    return retval;
+}
+
+/*
+ * The file operations for the pipe device
+ */
+struct file_operations scull_pipe_fops = {
+    .owner = THIS_MODULE,
+    .read = scull_p_read,
+    .write = scull_p_write,
+    .poll = scull_p_poll,
+    .unlocked_ioctl = scull_p_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = scull_p_mmap,
+    .open = scull_p_open,
+    .release = scull_p_release,
+};
+
+/*
+ * Set up a cdev entry.
+ */
+static void scull_p_setup_cdev(struct scull_pipe *dev, int index)
+{
+    int err, devno = scull_p_devno + index;
+
+    cdev_init(&dev->cdev, &scull_pipe_fops);
+    dev->cdev.owner = THIS_MODULE;
+    err = cdev_add(&dev->cdev, devno, 1);
+    /* Fail gracefully if need be */
+    if (err)
+        printk(KERN_NOTICE "Error %d adding scullpipe%d", err, index);
+    else
+        device_create(scull_class, NULL, devno, NULL, "scullpipe%d", index);
+}
+
+/*
+ * Initialize the pipe devs; return how many we did.
+ */
+int scull_p_init(dev_t firstdev)
+{
+    int result;
+
+    if (scull_p_buffer < 2) {
+        printk(KERN_WARNING "scull: scull_p_buffer must be at least 2\n");
+        return 0;
+    }
+    /* for the ring masks, and whole pages for mmap */
+    scull_p_buffer = roundup_pow_of_two(max_t(int, scull_p_buffer, PAGE_SIZE));
+
+    result = register_chrdev_region(firstdev, scull_p_nr_devs, "scullp");
+    if (result < 0) {
+        printk(KERN_NOTICE "Unable to get scullp region, error %d\n", result);
+        return 0;
+    }
+    scull_p_devno = firstdev;
+    scull_p_devices = kmalloc(scull_p_nr_devs * sizeof(struct scull_pipe), GFP_KERNEL);
+    if (scull_p_devices == NULL) {
+        unregister_chrdev_region(firstdev, scull_p_nr_devs);
+        return 0;
+    }
+    memset(scull_p_devices, 0, scull_p_nr_devs * sizeof(struct scull_pipe));
+    for (int i = 0; i < scull_p_nr_devs; i++) {
+        init_waitqueue_head(&(scull_p_devices[i].inq));
+        init_waitqueue_head(&(scull_p_devices[i].outq));
+        INIT_LIST_HEAD(&scull_p_devices[i].readers);
+        hrtimer_setup(&scull_p_devices[i].coal_timer, scull_p_coalesce_expired,
+                CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        mutex_init(&scull_p_devices[i].rlock);
+        mutex_init(&scull_p_devices[i].wlock);
+        sema_init(&scull_p_devices[i].sem, 1);
+        scull_p_setup_cdev(scull_p_devices + i, i);
+    }
+    return scull_p_nr_devs;
+}
+
+/*
+ * This is called by cleanup_module or on failure.
+ * It is required to never fail, even if nothing was initialized first
+ */
+void scull_p_cleanup(void)
+{
+    if (!scull_p_devices)
+        return; /* nothing else to release */
+
+    for (int i = 0; i < scull_p_nr_devs; i++) {
+        device_destroy(scull_class, scull_p_devno + i);
+        cdev_del(&scull_p_devices[i].cdev);
+        vfree(scull_p_devices[i].ring);
+    }
+    kfree(scull_p_devices);
+    unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
+    scull_p_devices = NULL; /* pedantic */
+}
@@ -1,21 +1,393 @@
+#include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
 
 #define SCULL_MAJOR 0
-#define SCULL_NR_DEVS 4
+#define SCULL_NR_DEVS 4     /* created at load; scullctl can add more */
+#define SCULL_MAX_DEVS 256  /* minors reserved for the bare devices */
 #define SCULL_QUANTUM 4000
 #define SCULL_QSET 1000
 
+#define SCULL_P_NR_DEVS 4  /* scullpipe0 through scullpipe3 */
+
+/*
+ * The pipe device is a simple circular buffer.  Here its default size,
+ * rounded up to a power of two at load time.
+ */
+#define SCULL_P_BUFFER 4000
+
+#define SCULL_L_NR_DEVS 4  /* scullog0 through scullog3 */
+#define SCULL_L_BUFFER (1 << 20)
+
+#define SCULL_MQ_NR_DEVS 4  /* scullmq0 through scullmq3 */
+#define SCULL_MQ_BUFFER (64 << 10)  /* per priority level */
+
+#define SCULL_PC_NR_DEVS 4  /* scullcpu0 through scullcpu3 */
+#define SCULL_PC_BUFFER (64 << 10)  /* per CPU */
+
+/* The four minors after the pipes are left for scullsingle, sculluid,
+ * scullwuid and scullpriv */
+#define SCULL_ACCESS_NR_DEVS 4
+
+/*
+ * Batched operations.  A batch is an array of extents, each naming a
+ * device offset, a user buffer and a length; the kernel fills in the
+ * number of bytes moved (or a negative error code) in ->result.
+ */
+struct scull_extent {
+    __u64 offset;               /* device offset */
+    __u64 addr;                 /* user buffer (ignored for PREALLOC) */
+    __u32 len;                  /* bytes to move, at most INT_MAX */
+    __s32 result;               /* bytes moved, or -errno */
+};
+
+#define SCULL_MAX_EXTENTS 1024
+
+/* io_uring passthrough (IORING_OP_URING_CMD) commands, in sqe->cmd_op */
+#define SCULL_URING_CMD_READV     1   /* gather read of an extent list */
+#define SCULL_URING_CMD_WRITEV    2   /* scatter write of an extent list */
+#define SCULL_URING_CMD_PREALLOC  3   /* allocate quanta backing the extents */
+
+/*
+ * A batch: the ioctl argument, and the payload in the SQE's cmd area for
+ * io_uring (it fits the 16 bytes of a regular SQE).  Extents are applied
+ * in offset order, so that the list is walked only once; overlapping
+ * writes at the same offset keep their submission order.
+ */
+struct scull_batch {
+    __u64 extents;              /* user pointer to struct scull_extent[] */
+    __u32 nr_extents;
+    __u32 flags;                /* must be zero */
+};
+
+/*
+ * Ioctl definitions
+ */
+
+/* Use 'k' as magic number */
+#define SCULL_IOC_MAGIC  'k'
+
+#define SCULL_IOCREADV     _IOW(SCULL_IOC_MAGIC, 1, struct scull_batch)
+#define SCULL_IOCWRITEV    _IOW(SCULL_IOC_MAGIC, 2, struct scull_batch)
+#define SCULL_IOCPREALLOC  _IOW(SCULL_IOC_MAGIC, 3, struct scull_batch)
+
+/*
+ * Pipe mode, "T"old by value and "Q"ueried by return value.  SPSC admits
+ * one reader and one writer, and takes no lock on the data path.
+ */
+#define SCULL_P_IOCSMODE   _IO(SCULL_IOC_MAGIC, 4)
+#define SCULL_P_IOCQMODE   _IO(SCULL_IOC_MAGIC, 5)
+
+#define SCULL_P_MODE_DEFAULT  0
+#define SCULL_P_MODE_SPSC     1
+
+/* Sleeping and waking for peers that mmap the pipe's ring */
+#define SCULL_P_IOCWAKE    _IO(SCULL_IOC_MAGIC, 6)
+#define SCULL_P_IOCWAITRD  _IO(SCULL_IOC_MAGIC, 7)
+#define SCULL_P_IOCWAITWR  _IO(SCULL_IOC_MAGIC, 8)
+
+/*
+ * Reader wakeup coalescing, per file descriptor: a sleeping reader is woken
+ * once "bytes" are queued, or "msgs" writes were made, or "delay_ns" after
+ * the first wakeup that was held back (0: no time limit).  The defaults,
+ * 1 and 1, wake on every write.
+ */
+struct scull_p_coalesce {
+    __u32 bytes;
+    __u32 msgs;
+    __u64 delay_ns;
+};
+
+#define SCULL_P_IOCSCOALESCE _IOW(SCULL_IOC_MAGIC, 9, struct scull_p_coalesce)
+#define SCULL_P_IOCGCOALESCE _IOR(SCULL_IOC_MAGIC, 10, struct scull_p_coalesce)
+#define SCULL_P_IOCGAVOIDED  _IOR(SCULL_IOC_MAGIC, 11, __u64) /* wakeups saved */
+
+/*
+ * Busy-poll budget of a reader, in microseconds: a blocking read spins on
+ * the ring this long before sleeping.  0 (the default) never spins.
+ */
+#define SCULL_P_IOCSBUSYPOLL _IO(SCULL_IOC_MAGIC, 12)
+#define SCULL_P_IOCQBUSYPOLL _IO(SCULL_IOC_MAGIC, 13)
+
+#define SCULL_P_BUSY_POLL_MAX 10000
+
+/* Broadcast log: bytes this reader lost to the retention limit */
+#define SCULL_L_IOCGDROPPED  _IOR(SCULL_IOC_MAGIC, 14, __u64)
+
+/*
+ * Message queue: drain up to "max" whole records into "buf", back to
+ * back, recording where each landed in "table" (struct scull_mq_rec[max]).
+ * Returns the number of records, also stored in ->count.
+ */
+#define SCULL_MQ_IOCREADV    _IOWR(SCULL_IOC_MAGIC, 15, struct scull_mq_batch)
+
+/*
+ * Message queue priority: the level, 0 (lowest, the default) to
+ * SCULL_MQ_NR_PRIOS - 1, this file writes at.  QREADY returns a bitmask
+ * of the levels that have records queued.
+ */
+#define SCULL_MQ_IOCSPRIO    _IO(SCULL_IOC_MAGIC, 16)
+#define SCULL_MQ_IOCQPRIO    _IO(SCULL_IOC_MAGIC, 17)
+#define SCULL_MQ_IOCQREADY   _IO(SCULL_IOC_MAGIC, 18)
+
+#define SCULL_MQ_NR_PRIOS 4
+
+/*
+ * Per-CPU device: the order a file reads records in, merged by timestamp
+ * (the default) or grouped per CPU; and the records dropped on full rings.
+ */
+#define SCULL_PC_IOCSORDER   _IO(SCULL_IOC_MAGIC, 19)
+#define SCULL_PC_IOCQORDER   _IO(SCULL_IOC_MAGIC, 20)
+#define SCULL_PC_IOCGDROPPED _IOR(SCULL_IOC_MAGIC, 21, __u64)
+
+#define SCULL_PC_ORDER_TIME 0
+#define SCULL_PC_ORDER_CPU  1
+
+/*
+ * The control device, /dev/scullctl: create a bare device with its own
+ * geometry, or destroy one (arg is its index).  Needs CAP_SYS_ADMIN.
+ */
+#define SCULL_CTL_IOCCREATE  _IOWR(SCULL_IOC_MAGIC, 22, struct scull_ctl)
+#define SCULL_CTL_IOCDESTROY _IO(SCULL_IOC_MAGIC, 23)
+
+/*
+ * Freezing a bare device, "T"old by value (1 freezes, 0 thaws) and
+ * "Q"ueried: a frozen device is copied to every NUMA node and read from
+ * the copy on the reader's node.  Any write thaws it again.
+ */
+#define SCULL_IOCSFROZEN   _IO(SCULL_IOC_MAGIC, 24)
+#define SCULL_IOCQFROZEN   _IO(SCULL_IOC_MAGIC, 25)
+
+#define SCULL_IOC_MAXNR 25
+
+/*
+ * The first page of a pipe's mapping; the ring data follows it.  The
+ * indices are free running, and sit on separate cache lines.  A sleeper
+ * in the kernel sets rd_wait (wr_wait) before sleeping; a producer
+ * (consumer) working on the mapping must issue a full barrier after
+ * moving its index, and SCULL_P_IOCWAKE if it then finds the flag set.
+ */
+struct scull_p_ring {
+    __u32 in;                   /* producer index */
+    __u32 pad0[15];
+    __u32 out;                  /* consumer index */
+    __u32 pad1[15];
+    __u32 size;                 /* bytes of data, a power of two */
+    __u32 rd_wait;              /* a reader is asleep */
+    __u32 wr_wait;              /* a writer is asleep */
+};
+
+struct scull_mq_rec {
+    __u32 offset;               /* where the record starts in the buffer */
+    __u32 len;                  /* and its length */
+};
+
+struct scull_mq_batch {
+    __u64 buf;                  /* user buffer for the records */
+    __u64 table;                /* user array of struct scull_mq_rec */
+    __u32 buflen;               /* size of buf */
+    __u32 max;                  /* entries in table */
+    __u32 count;                /* out: records returned */
+    __u32 flags;                /* must be zero */
+};
+
+#define SCULL_MQ_MAX_BATCH 1024
+
+/*
+ * What a read of a per-CPU device returns for each record, followed by
+ * the payload and padding up to a multiple of 8 bytes.
+ */
+struct scull_pc_rec {
+    __u64 ts;                   /* local_clock() of the writer's CPU */
+    __u32 cpu;                  /* whose ring it was queued on */
+    __u32 len;                  /* payload bytes */
+};
+
+/*
+ * Where a bare device puts its quanta.  The device itself, its list nodes
+ * and pointer arrays always live on its NUMA node.  A REPLICATE device
+ * keeps its quanta there too, and is copied to every node, for readers,
+ * whenever its last writer closes it.
+ */
+#define SCULL_PLACE_FIXED       0   /* quanta on the device's node too */
+#define SCULL_PLACE_INTERLEAVE  1   /* quanta round robin over the nodes */
+#define SCULL_PLACE_LOCAL       2   /* quanta on the writer's node */
+#define SCULL_PLACE_REPLICATE   3   /* read from a per-node copy */
+
+struct scull_ctl {
+    __s32 index;                /* scullN; -1 for any free N. Out: N */
+    __s32 quantum;              /* 0 for the scull_quantum default */
+    __s32 qset;                 /* 0 for the scull_qset default */
+    __s32 node;                 /* NUMA node; -1 for no preference */
+    __u32 policy;               /* SCULL_PLACE_* */
+    __u32 flags;                /* must be zero */
+};
+
+/* The rest is the module's own; user programs (see bench/) stop here */
+#ifdef __KERNEL__
+
 struct scull_qset {
     void **data;
     struct scull_qset *next;
+    int nr_quanta;              /* entries of data[] populated */
+};
+
+/*
+ * An O_APPEND write in flight: the slice of the device it reserved, on
+ * dev->appends in reservation order until published.  Whoever publishes
+ * it frees it, so that its writer need not stay around for that.
+ */
+struct scull_append {
+    struct list_head list;
+    unsigned long pos, end;     /* the slice */
+    u64 seq;                    /* its place in the reservation order */
+    bool done;                  /* the copy is over, it can be published */
+};
+
+/*
+ * Buckets of the list node fullness histogram: bucket 0 counts the nodes
+ * with no quantum, bucket b those over (b - 1) and up to b tenths full.
+ */
+#define SCULL_FILL_BUCKETS 11
+
+/*
+ * Memory for one write or one batch, allocated before dev->sem is taken so
+ * that direct reclaim never runs inside the critical section.  Spares that
+ * end up not being installed are freed once the write is done.  A batch
+ * allocates at most SCULL_PREALLOC_MAX quanta ahead per lock round trip.
+ */
+#define SCULL_PREALLOC_INLINE 2     /* quanta a single write can need */
+#define SCULL_PREALLOC_MAX 256
+
+struct scull_prealloc {
+    struct scull_qset *qs;      /* spare list nodes, chained through ->next */
+    void **data;                /* spare pointer arrays, chained through [0] */
+    void **quanta;              /* nr_quanta spares of "quantum_size" bytes */
+    void *inline_quanta[SCULL_PREALLOC_INLINE]; /* ->quanta, unless a batch needs more */
+    int nr_quanta, max_quanta;
+    int qset, quantum_size;     /* geometry the spares were allocated for */
+    int need_qs, need_data, need_quanta; /* to allocate before the next try */
+    long guess_q, guess_item;   /* first quantum, list node not guessed yet */
+};
+
+/*
+ * A read-only copy of a device's data on each NUMA node with memory, as a
+ * flat array of quanta indexed by position / quantum (NULL for holes).
+ * Readers find it in dev->replica under SRCU; any change to the data
+ * drops it first.
+ */
+struct scull_replica {
+    struct rcu_head rcu;
+    unsigned long size;         /* of the device when it was copied */
+    int quantum;
+    int home;                   /* a node that surely has a copy */
+    unsigned long nr_quanta;    /* entries of each array */
+    void **quanta[];            /* per node, NULL where there is no copy */
+};
+
+/*
+ * Per-CPU statistics of a bare scull device, summed up in debugfs.  The
+ * histograms are log2-bucketed latencies in nanoseconds.
+ */
+enum scull_stat {
+    SCULL_STAT_READS,
+    SCULL_STAT_READ_BYTES,
+    SCULL_STAT_WRITES,
+    SCULL_STAT_WRITE_BYTES,
+    SCULL_STAT_FOLLOW_HOPS,     /* list nodes walked by scull_follow */
+    SCULL_STAT_ALLOCS,
+    SCULL_STAT_ALLOC_FAILS,
+    SCULL_STAT_RESTARTS,        /* -ERESTARTSYS returns */
+    SCULL_STAT_REPLICA_READS,   /* reads served from a node's copy */
+    SCULL_STAT_LOCK_ACQUIRES,   /* dev->sem, with scull_lock_stats set */
+    SCULL_STAT_LOCK_CONTENDED,  /* ... found held by somebody else */
+    SCULL_STAT_LOCK_WAIT_NS,
+    SCULL_STAT_LOCK_HOLD_NS,
+    SCULL_STAT_NR
+};
+
+enum scull_hist {
+    SCULL_HIST_READ,
+    SCULL_HIST_WRITE,
+    SCULL_HIST_LOCK_WAIT,
+    SCULL_HIST_LOCK_HOLD,
+    SCULL_HIST_NR
+};
+
+#define SCULL_HIST_BUCKETS 64
+
+struct scull_stats {
+    u64 count[SCULL_STAT_NR];
+    u64 hist[SCULL_HIST_NR][SCULL_HIST_BUCKETS];
 };
 
 struct scull_dev {
     struct scull_qset *data;    /* Pointer to first quantum set */
+    struct scull_qset *last_qs; /* node found by the last scull_follow */
+    int last_item;              /* ... and its index in the list */
     int quantum;                /* the current quantum size */
     int qset;                   /* the current array size */
     unsigned long size;         /* amount of data stored here */
+    int nr_qsets;               /* list nodes allocated, for /proc */
+    int nr_quanta;              /* quanta allocated, for /proc */
+    int nr_arrays;              /* qset pointer arrays allocated */
+    int fill_hist[SCULL_FILL_BUCKETS]; /* list nodes, by fullness */
+    unsigned long reserved;     /* end of the last O_APPEND reservation */
+    struct list_head appends;   /* O_APPEND slices not published yet */
+    u64 append_seq;             /* of the last reservation */
+    u64 published_seq;          /* of the last slice published */
+    int nappend;                /* entries on "appends" */
+    unsigned long pending_size; /* plain writes past unpublished slices */
+    wait_queue_head_t append_wq; /* appenders wait here to be published, trim too */
     unsigned int access_key;    /* used by sculluid and scullpriv */
+    int policy;                 /* SCULL_PLACE_*, for new quanta */
+    int next_node;              /* last node interleaving used */
+    int *node_quanta;           /* quanta allocated, per NUMA node */
+    struct scull_replica __rcu *replica; /* set while frozen */
+    unsigned long data_gen;     /* changes to the data, under sem */
+    struct work_struct freeze_work; /* on the last writer's close */
+    atomic_t nwriters;          /* files open for writing */
+    struct scull_stats __percpu *stats;
+    u64 locked_at;              /* local_clock() when sem was taken */
+    unsigned long locked_ip;    /* ... and where */
+    u64 lock_max_wait;          /* longest wait for sem, in ns */
+    u64 lock_max_hold;          /* longest hold of sem, in ns */
+    unsigned long lock_max_ip;  /* ... and where it was taken */
     struct semaphore sem;       /* mutual exclusion semaphore */
     struct cdev cdev;           /* Char device structure */
-};
+    struct device dev;          /* its lifetime is the device's */
+    struct dentry *debugfs;     /* its directory there */
+    struct rcu_head rcu;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * The different configurable parameters
+ */
+extern int scull_major;     /* main.c */
+extern int scull_nr_devs;
+extern int scull_quantum;
+extern int scull_qset;
+extern int scull_node;
+extern struct class *scull_class;
+extern const struct attribute_group scull_stats_group; /* stats.c */
+
+extern int scull_p_buffer;  /* pipe.c */
+extern int scull_l_buffer;  /* log.c */
+extern int scull_mq_buffer; /* mq.c */
+extern int scull_pc_buffer; /* percpu.c */
+
+/*
+ * Prototypes for shared functions
+ */
+void    scull_debugfs_create(void);  /* stats.c */
+void    scull_debugfs_add(struct scull_dev *dev);
+void    scull_debugfs_del(struct scull_dev *dev);
+void    scull_debugfs_remove(void);
+int     scull_p_init(dev_t dev);
+void    scull_p_cleanup(void);
+int     scull_l_init(dev_t dev);
+void    scull_l_cleanup(void);
+int     scull_mq_init(dev_t dev);
+void    scull_mq_cleanup(void);
+int     scull_pc_init(dev_t dev);
+void    scull_pc_cleanup(void);
 
+#endif /* __KERNEL__ */
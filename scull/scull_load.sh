@@ -15,47 +15,14 @@ fi
 # and use a pathname, as insmod doesn't look in . by default
 insmod ./$module.ko $* || exit 1
 
-# retrieve major number
-major=$(awk "\$2==\"$module\" {print \$1}" /proc/devices)
-
-# Remove stale nodes and replace them, then give gid and perms
-# Usually the script is shorter, it's scull that has several devices in it.
-
-rm -f /dev/${device}[0-3]
-mknod /dev/${device}0 c $major 0
-mknod /dev/${device}1 c $major 1
-mknod /dev/${device}2 c $major 2
-mknod /dev/${device}3 c $major 3
-ln -sf ${device}0 /dev/${device}
-chgrp $group /dev/${device}[0-3] 
-chmod $mode  /dev/${device}[0-3]
-
-#rm -f /dev/${device}pipe[0-3]
-#mknod /dev/${device}pipe0 c $major 4
-#mknod /dev/${device}pipe1 c $major 5
-#mknod /dev/${device}pipe2 c $major 6
-#mknod /dev/${device}pipe3 c $major 7
-#ln -sf ${device}pipe0 /dev/${device}pipe
-#chgrp $group /dev/${device}pipe[0-3] 
-#chmod $mode  /dev/${device}pipe[0-3]
-
-#rm -f /dev/${device}single
-#mknod /dev/${device}single  c $major 8
-#chgrp $group /dev/${device}single
-#chmod $mode  /dev/${device}single
-
-#rm -f /dev/${device}uid
-#mknod /dev/${device}uid   c $major 9
-#chgrp $group /dev/${device}uid
-#chmod $mode  /dev/${device}uid
-
-#rm -f /dev/${device}wuid
-#mknod /dev/${device}wuid  c $major 10
-#chgrp $group /dev/${device}wuid
-#chmod $mode  /dev/${device}wuid
-
-#rm -f /dev/${device}priv
-#mknod /dev/${device}priv  c $major 11
-#chgrp $group /dev/${device}priv
-#chmod $mode  /dev/${device}priv
-
+# The module registers every device in /sys/class/scull, so udev (or
+# devtmpfs) creates the nodes, however many scull_nr_devs etc. asked for.
+# Wait for them, then give gid and perms and add the usual symlinks.
+command -v udevadm > /dev/null && udevadm settle
+
+for family in "" pipe og mq cpu; do
+    [ -e /dev/${device}${family}0 ] || continue
+    chgrp $group /dev/${device}${family}[0-9]*
+    chmod $mode  /dev/${device}${family}[0-9]*
+    ln -sf ${device}${family}0 /dev/${device}${family}
+done
@@ -0,0 +1,168 @@
+/*
+ * scull_trace.h -- tracepoints for the bare scull devices
+ *
+ * Stable hooks for perf and BPF: "perf list 'scull:*'".  Disabled, each
+ * costs a static branch; main.c defines CREATE_TRACE_POINTS.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/device.h>
+
+DECLARE_EVENT_CLASS(scull_rw,
+
+    TP_PROTO(struct scull_dev *dev, loff_t pos, size_t count, ssize_t ret),
+
+    TP_ARGS(dev, pos, count, ret),
+
+    TP_STRUCT__entry(
+        __string(name, dev_name(&dev->dev))
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name);
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%s pos=%lld count=%zu ret=%zd",
+        __get_str(name), __entry->pos, __entry->count, __entry->ret)
+);
+
+/* A read or write that asked for "count" bytes at "pos" */
+DEFINE_EVENT(scull_rw, scull_read,
+    TP_PROTO(struct scull_dev *dev, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(dev, pos, count, ret)
+);
+
+DEFINE_EVENT(scull_rw, scull_write,
+    TP_PROTO(struct scull_dev *dev, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(dev, pos, count, ret)
+);
+
+/* scull_follow looked for list node "item", walking "hops" nodes */
+TRACE_EVENT(scull_follow,
+
+    TP_PROTO(struct scull_dev *dev, int item, int hops),
+
+    TP_ARGS(dev, item, hops),
+
+    TP_STRUCT__entry(
+        __string(name, dev_name(&dev->dev))
+        __field(int, item)
+        __field(int, hops)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name);
+        __entry->item = item;
+        __entry->hops = hops;
+    ),
+
+    TP_printk("%s item=%d hops=%d",
+        __get_str(name), __entry->item, __entry->hops)
+);
+
+DECLARE_EVENT_CLASS(scull_quantum,
+
+    TP_PROTO(struct scull_dev *dev, void *quantum, int size),
+
+    TP_ARGS(dev, quantum, size),
+
+    TP_STRUCT__entry(
+        __string(name, dev_name(&dev->dev))
+        __field(void *, quantum)
+        __field(int, size)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name);
+        __entry->quantum = quantum;
+        __entry->size = size;
+    ),
+
+    TP_printk("%s quantum=%p size=%d",
+        __get_str(name), __entry->quantum, __entry->size)
+);
+
+/* A quantum joined the device, or left it */
+DEFINE_EVENT(scull_quantum, scull_quantum_alloc,
+    TP_PROTO(struct scull_dev *dev, void *quantum, int size),
+    TP_ARGS(dev, quantum, size)
+);
+
+DEFINE_EVENT(scull_quantum, scull_quantum_free,
+    TP_PROTO(struct scull_dev *dev, void *quantum, int size),
+    TP_ARGS(dev, quantum, size)
+);
+
+/* The device is about to be emptied */
+TRACE_EVENT(scull_trim,
+
+    TP_PROTO(struct scull_dev *dev),
+
+    TP_ARGS(dev),
+
+    TP_STRUCT__entry(
+        __string(name, dev_name(&dev->dev))
+        __field(unsigned long, size)
+        __field(int, nr_quanta)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name);
+        __entry->size = dev->size;
+        __entry->nr_quanta = dev->nr_quanta;
+    ),
+
+    TP_printk("%s size=%lu quanta=%d",
+        __get_str(name), __entry->size, __entry->nr_quanta)
+);
+
+/* dev->sem was taken after waiting "ns", or released after holding it */
+DECLARE_EVENT_CLASS(scull_lock_class,
+
+    TP_PROTO(struct scull_dev *dev, u64 ns),
+
+    TP_ARGS(dev, ns),
+
+    TP_STRUCT__entry(
+        __string(name, dev_name(&dev->dev))
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name);
+        __entry->ns = ns;
+    ),
+
+    TP_printk("%s ns=%llu", __get_str(name), __entry->ns)
+);
+
+DEFINE_EVENT(scull_lock_class, scull_lock,
+    TP_PROTO(struct scull_dev *dev, u64 ns),
+    TP_ARGS(dev, ns)
+);
+
+DEFINE_EVENT(scull_lock_class, scull_unlock,
+    TP_PROTO(struct scull_dev *dev, u64 ns),
+    TP_ARGS(dev, ns)
+);
+
+#endif /* _SCULL_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
@@ -5,11 +5,5 @@ device="scull"
 # invoke rmmod with all arguments we got
 rmmod $module $* || exit 1
 
-# Remove stale nodes
-rm -f /dev/${device} /dev/${device}[0-3] 
-rm -f /dev/${device}priv
-rm -f /dev/${device}pipe /dev/${device}pipe[0-3]
-rm -f /dev/${device}single
-rm -f /dev/${device}uid
-rm -f /dev/${device}wuid
-
+# The nodes go away with the devices; remove the symlinks we added
+rm -f /dev/${device} /dev/${device}pipe /dev/${device}og /dev/${device}mq /dev/${device}cpu
@@ -0,0 +1,242 @@
+/*
+ * stats.c -- debugfs view of the bare scull devices' statistics
+ *
+ * The counters and histograms themselves are per CPU (struct scull_stats)
+ * and bumped from main.c without any lock; this file only sums them up,
+ * in /sys/kernel/debug/scull/scullN/stats, and clears them through the
+ * "reset" file next to it.  "memory" next to them tells what the data
+ * really costs, and on which NUMA nodes.  The counters also appear one
+ * per file, the sysfs way, in /sys/class/scull/scullN/stats.
+ */
+
+#include <linux/module.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc_size_roundup() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/percpu.h>	/* per_cpu_ptr() */
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/cdev.h>
+#include <linux/semaphore.h>
+#include <linux/device.h>	/* struct dev_ext_attribute */
+#include <linux/nodemask.h>	/* for_each_node_state() */
+#include <linux/rcupdate.h>	/* rcu_access_pointer() */
+
+#include "scull.h"
+
+static struct dentry *scull_debugfs_root;
+
+static const char * const scull_stat_names[SCULL_STAT_NR] = {
+    [SCULL_STAT_READS]          = "reads",
+    [SCULL_STAT_READ_BYTES]     = "read_bytes",
+    [SCULL_STAT_WRITES]         = "writes",
+    [SCULL_STAT_WRITE_BYTES]    = "write_bytes",
+    [SCULL_STAT_FOLLOW_HOPS]    = "follow_hops",
+    [SCULL_STAT_ALLOCS]         = "allocs",
+    [SCULL_STAT_ALLOC_FAILS]    = "alloc_fails",
+    [SCULL_STAT_RESTARTS]       = "restarts",
+    [SCULL_STAT_REPLICA_READS]  = "replica_reads",
+    [SCULL_STAT_LOCK_ACQUIRES]  = "lock_acquires",
+    [SCULL_STAT_LOCK_CONTENDED] = "lock_contended",
+    [SCULL_STAT_LOCK_WAIT_NS]   = "lock_wait_ns",
+    [SCULL_STAT_LOCK_HOLD_NS]   = "lock_hold_ns",
+};
+
+static const char * const scull_hist_names[SCULL_HIST_NR] = {
+    [SCULL_HIST_READ]      = "read_ns",
+    [SCULL_HIST_WRITE]     = "write_ns",
+    [SCULL_HIST_LOCK_WAIT] = "lock_wait_ns",
+    [SCULL_HIST_LOCK_HOLD] = "lock_hold_ns",
+};
+
+static u64 scull_stat_sum(struct scull_dev *dev, int i)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += READ_ONCE(per_cpu_ptr(dev->stats, cpu)->count[i]);
+    return sum;
+}
+
+/*
+ * Sum the per-CPU copies.  The CPUs keep counting meanwhile, so this is
+ * a snapshot that is only exact when the device is idle.
+ */
+static int scull_stats_show(struct seq_file *s, void *v)
+{
+    struct scull_dev *dev = s->private;
+    u64 sum;
+    int cpu;
+
+    for (int i = 0; i < SCULL_STAT_NR; i++)
+        seq_printf(s, "%-14s %llu\n", scull_stat_names[i], scull_stat_sum(dev, i));
+    seq_printf(s, "%-14s %llu\n", "lock_max_wait", READ_ONCE(dev->lock_max_wait));
+    seq_printf(s, "%-14s %llu at %pS\n", "lock_max_hold", READ_ONCE(dev->lock_max_hold),
+            (void *)READ_ONCE(dev->lock_max_ip));
+
+    /* bucket b holds [2^(b-1), 2^b) nanoseconds, bucket 0 just 0 */
+    for (int h = 0; h < SCULL_HIST_NR; h++) {
+        seq_printf(s, "\n%s:\n", scull_hist_names[h]);
+        for (int b = 0; b < SCULL_HIST_BUCKETS; b++) {
+            sum = 0;
+            for_each_possible_cpu(cpu)
+                sum += READ_ONCE(per_cpu_ptr(dev->stats, cpu)->hist[h][b]);
+            if (sum)
+                seq_printf(s, "  %20llu %llu\n", b ? 1ULL << (b - 1) : 0, sum);
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_stats);
+
+/* Any write clears all the counters; updates racing with it may survive */
+static ssize_t scull_reset_write(struct file *filp, const char __user *buf,
+        size_t count, loff_t *f_pos)
+{
+    struct scull_dev *dev = filp->private_data;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(dev->stats, cpu), 0, sizeof(struct scull_stats));
+    WRITE_ONCE(dev->lock_max_wait, 0);
+    WRITE_ONCE(dev->lock_max_hold, 0);
+    WRITE_ONCE(dev->lock_max_ip, 0);
+    return count;
+}
+
+static const struct file_operations scull_reset_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = scull_reset_write,
+    .llseek = noop_llseek,
+};
+
+/*
+ * The memory footprint of a device, from the counters the writers keep:
+ * what its quanta, pointer arrays and list nodes take from the slab
+ * allocator, and how much of that holds no data.  Like /proc/scullmem it
+ * does not take dev->sem, so the figures may be a moment apart.
+ */
+static int scull_memory_show(struct seq_file *s, void *v)
+{
+    struct scull_dev *dev = s->private;
+    int quantum = READ_ONCE(dev->quantum), qset = READ_ONCE(dev->qset);
+    unsigned long size = READ_ONCE(dev->size);
+    unsigned long nr_quanta = READ_ONCE(dev->nr_quanta);
+    unsigned long quanta_bytes, metadata, used;
+    int node;
+
+    quanta_bytes = nr_quanta * kmalloc_size_roundup(quantum);
+    metadata = READ_ONCE(dev->nr_qsets) * kmalloc_size_roundup(sizeof(struct scull_qset)) +
+        READ_ONCE(dev->nr_arrays) * kmalloc_size_roundup(qset * sizeof(char *));
+    used = min(size, nr_quanta * quantum); /* holes hold no quantum */
+
+    seq_printf(s, "size           %lu\n", size);
+    seq_printf(s, "quantum        %d\n", quantum);
+    seq_printf(s, "qset           %d\n", qset);
+    seq_printf(s, "quanta         %lu\n", nr_quanta);
+    seq_printf(s, "quanta_bytes   %lu\n", quanta_bytes);
+    seq_printf(s, "metadata_bytes %lu\n", metadata);
+    seq_printf(s, "slack_bytes    %lu\n", quanta_bytes - used);
+    seq_printf(s, "  slab         %lu\n", quanta_bytes - nr_quanta * quantum);
+    seq_printf(s, "  unwritten    %lu\n", nr_quanta * quantum - used);
+    seq_printf(s, "frozen         %d\n", !!rcu_access_pointer(dev->replica));
+
+    /* where the quanta actually are, whatever was asked for */
+    seq_puts(s, "\nnodes:\n");
+    for_each_node_state(node, N_MEMORY)
+        seq_printf(s, "  %-4d %d\n", node, READ_ONCE(dev->node_quanta[node]));
+
+    /* list nodes by how many of their qset quanta are there */
+    seq_puts(s, "\nfill:\n");
+    for (int b = 0; b < SCULL_FILL_BUCKETS; b++)
+        seq_printf(s, "  <=%3d%% %d\n", b * 100 / (SCULL_FILL_BUCKETS - 1),
+                READ_ONCE(dev->fill_hist[b]));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_memory);
+
+/* sysfs: one file per counter, the counter index in ->var */
+static ssize_t scull_stat_attr_show(struct device *d, struct device_attribute *attr,
+        char *buf)
+{
+    struct dev_ext_attribute *ea = container_of(attr, struct dev_ext_attribute, attr);
+
+    return sysfs_emit(buf, "%llu\n", scull_stat_sum(dev_get_drvdata(d),
+                (unsigned long)ea->var));
+}
+
+#define SCULL_STAT_ATTR(_name, _i)                                      \
+    static struct dev_ext_attribute scull_attr_##_name = {              \
+        __ATTR(_name, 0444, scull_stat_attr_show, NULL), (void *)(_i)   \
+    }
+
+SCULL_STAT_ATTR(reads, SCULL_STAT_READS);
+SCULL_STAT_ATTR(read_bytes, SCULL_STAT_READ_BYTES);
+SCULL_STAT_ATTR(writes, SCULL_STAT_WRITES);
+SCULL_STAT_ATTR(write_bytes, SCULL_STAT_WRITE_BYTES);
+SCULL_STAT_ATTR(follow_hops, SCULL_STAT_FOLLOW_HOPS);
+SCULL_STAT_ATTR(allocs, SCULL_STAT_ALLOCS);
+SCULL_STAT_ATTR(alloc_fails, SCULL_STAT_ALLOC_FAILS);
+SCULL_STAT_ATTR(restarts, SCULL_STAT_RESTARTS);
+SCULL_STAT_ATTR(replica_reads, SCULL_STAT_REPLICA_READS);
+SCULL_STAT_ATTR(lock_acquires, SCULL_STAT_LOCK_ACQUIRES);
+SCULL_STAT_ATTR(lock_contended, SCULL_STAT_LOCK_CONTENDED);
+SCULL_STAT_ATTR(lock_wait_ns, SCULL_STAT_LOCK_WAIT_NS);
+SCULL_STAT_ATTR(lock_hold_ns, SCULL_STAT_LOCK_HOLD_NS);
+
+static struct attribute *scull_stats_attrs[] = {
+    &scull_attr_reads.attr.attr,
+    &scull_attr_read_bytes.attr.attr,
+    &scull_attr_writes.attr.attr,
+    &scull_attr_write_bytes.attr.attr,
+    &scull_attr_follow_hops.attr.attr,
+    &scull_attr_allocs.attr.attr,
+    &scull_attr_alloc_fails.attr.attr,
+    &scull_attr_restarts.attr.attr,
+    &scull_attr_replica_reads.attr.attr,
+    &scull_attr_lock_acquires.attr.attr,
+    &scull_attr_lock_contended.attr.attr,
+    &scull_attr_lock_wait_ns.attr.attr,
+    &scull_attr_lock_hold_ns.attr.attr,
+    NULL
+};
+
+const struct attribute_group scull_stats_group = {
+    .name = "stats",
+    .attrs = scull_stats_attrs,
+};
+
+/* Add the directory of a device; debugfs errors are not fatal */
+void scull_debugfs_add(struct scull_dev *dev)
+{
+    struct dentry *dir;
+
+    dir = debugfs_create_dir(dev_name(&dev->dev), scull_debugfs_root);
+    debugfs_create_file("stats", 0444, dir, dev, &scull_stats_fops);
+    debugfs_create_file("reset", 0200, dir, dev, &scull_reset_fops);
+    debugfs_create_file("memory", 0444, dir, dev, &scull_memory_fops);
+    dev->debugfs = dir;
+}
+
+/* Remove it, waiting for its files to be idle */
+void scull_debugfs_del(struct scull_dev *dev)
+{
+    debugfs_remove_recursive(dev->debugfs);
+    dev->debugfs = NULL;
+}
+
+void scull_debugfs_create(void)
+{
+    scull_debugfs_root = debugfs_create_dir("scull", NULL);
+}
+
+void scull_debugfs_remove(void)
+{
+    debugfs_remove_recursive(scull_debugfs_root); /* fine if NULL */
+    scull_debugfs_root = NULL;
+}